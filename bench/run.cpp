@@ -1,8 +1,12 @@
 #include <algorithm>
 #include <benchmark/benchmark.h>
 #include <cctype>
+#include <chrono>
+#include <cmath>
 #include <picomath.hpp>
+#include <picomath_tiered.hpp>
 #include <string>
+#include <vector>
 
 static void BM_simpleExpression(benchmark::State &state) // NOLINT google-runtime-references
 {
@@ -56,6 +60,250 @@ static void BM_complexExpression(benchmark::State &state) // NOLINT google-runti
     }
 }
 
+static void BM_budgetedExpression(benchmark::State &state) // NOLINT google-runtime-references
+{
+    picomath::PicoMath ctx;
+    ctx.addVariable("x") = 2.0;
+    ctx.addVariable("y") = 3.0;
+    ctx.addVariable("z") = 5.0;
+    ctx.addVariable("w") = 7.0;
+    picomath::Budget budget;
+    budget.maxLength     = 1024;
+    budget.maxOperations = 1000;
+    budget.maxDepth      = 64;
+    budget.deadline      = std::chrono::steady_clock::now() + std::chrono::hours(1);
+    while (state.KeepRunning()) {
+        benchmark::DoNotOptimize(
+            ctx.evalExpression("((((x-(y/(z*w)))/(((x-y)*z)-w))/((((x+y)*z)-w)-((x+y)-(z*w))))/"
+                               "(((((x-y)*z)-w)*((x+y)-(z/w)))*(((x+y)-(z*w))+((x/y)+(z+w)))))",
+                               budget));
+        benchmark::ClobberMemory();
+    }
+}
+
+static void BM_compiledExpression(benchmark::State &state) // NOLINT google-runtime-references
+{
+    picomath::PicoMath ctx;
+    ctx.addVariable("x") = 2.0;
+    ctx.addVariable("y") = 3.0;
+    ctx.addVariable("z") = 5.0;
+    ctx.addVariable("w") = 7.0;
+    auto expression = ctx.compileExpression("((((x-(y/(z*w)))/(((x-y)*z)-w))/((((x+y)*z)-w)-((x+y)-(z*w))))/"
+                                            "(((((x-y)*z)-w)*((x+y)-(z/w)))*(((x+y)-(z*w))+((x/y)+(z+w)))))");
+    while (state.KeepRunning()) {
+        benchmark::DoNotOptimize(expression.eval());
+        benchmark::ClobberMemory();
+    }
+}
+
+static void BM_pureFunctionCache(benchmark::State &state) // NOLINT google-runtime-references
+{
+    picomath::PicoMath ctx;
+    auto &             x = ctx.addVariable("x");
+    ctx.addFunction(
+        "table",
+        [](picomath::number_t input) -> picomath::number_t {
+            picomath::number_t ret = 0;
+            for (int i = 0; i < 64; i++) {
+                ret += std::sin(input + static_cast<picomath::number_t>(i));
+            }
+            return ret;
+        },
+        picomath::Purity::Pure);
+    if (state.range(0) != 0) {
+        ctx.setFunctionCache("table", 64);
+    }
+    int i = 0;
+    while (state.KeepRunning()) {
+        x = static_cast<picomath::number_t>(i++ % 16);
+        benchmark::DoNotOptimize(ctx.evalExpression("table(x) * 2 + table(x + 1)"));
+        benchmark::ClobberMemory();
+    }
+}
+
+static void BM_list(benchmark::State &state) // NOLINT google-runtime-references
+{
+    picomath::PicoMath              ctx;
+    std::vector<picomath::number_t> out(4);
+    std::vector<uint64_t>           errors(1);
+    while (state.KeepRunning()) {
+        benchmark::DoNotOptimize(ctx.evalList("2 * 4, 2, (100 * 10), pow(2,8)", out.data(), out.size(), errors.data()));
+        benchmark::ClobberMemory();
+    }
+}
+
+static void BM_compiledList(benchmark::State &state) // NOLINT google-runtime-references
+{
+    picomath::PicoMath ctx;
+    auto &             x    = ctx.addVariable("x");
+    std::string        list = "x";
+    for (int i = 1; i < 256; i++) {
+        list += ", x * " + std::to_string(i) + " + sqrt(x)";
+    }
+    auto                            compiled = ctx.compileList(list.c_str());
+    std::vector<picomath::number_t> out(compiled.outputCount());
+    std::vector<uint64_t>           errors((out.size() + 63) / 64);
+    while (state.KeepRunning()) {
+        x += 1;
+        benchmark::DoNotOptimize(compiled.evalList(out.data(), out.size(), errors.data()));
+        benchmark::ClobberMemory();
+    }
+    state.SetItemsProcessed(static_cast<int64_t>(state.iterations() * out.size()));
+}
+
+static auto ruleFormulas() -> std::vector<std::string> {
+    std::vector<std::string> formulas;
+    for (int i = 0; i < 2000; i++) {
+        std::string threshold = std::to_string(i % 50);
+        formulas.push_back(i % 2 == 0 ? "sqrt(x*x + y*y) - " + threshold
+                                      : "(x - y) * " + threshold + " + sqrt(x*x + y*y)");
+    }
+    return formulas;
+}
+
+static void BM_independentRules(benchmark::State &state) // NOLINT google-runtime-references
+{
+    picomath::PicoMath ctx;
+    auto &             x        = ctx.addVariable("x");
+    auto &             y        = ctx.addVariable("y");
+    auto               formulas = ruleFormulas();
+    while (state.KeepRunning()) {
+        x += 1;
+        y -= 1;
+        for (const auto &formula : formulas) {
+            benchmark::DoNotOptimize(ctx.evalExpression(formula.c_str()));
+        }
+        benchmark::ClobberMemory();
+    }
+}
+
+static void BM_ruleSet(benchmark::State &state) // NOLINT google-runtime-references
+{
+    picomath::PicoMath ctx;
+    auto &             x = ctx.addVariable("x");
+    auto &             y = ctx.addVariable("y");
+    picomath::RuleSet  rules(ctx);
+    for (const auto &formula : ruleFormulas()) {
+        rules.addRule(formula.c_str());
+    }
+    std::vector<picomath::number_t> out;
+    std::vector<uint64_t>           errors;
+    while (state.KeepRunning()) {
+        x += 1;
+        y -= 1;
+        benchmark::DoNotOptimize(rules.evaluate(out, errors));
+        benchmark::ClobberMemory();
+    }
+}
+
+static void BM_batchEvaluation(benchmark::State &state) // NOLINT google-runtime-references
+{
+    picomath::PicoMath ctx;
+    auto &             x = ctx.addVariable("x");
+    auto &             y = ctx.addVariable("y");
+    y                    = 2.0;
+    auto                            expression = ctx.compileExpression("sqrt(x * x + y * y) * 2 + cos(x)");
+    std::vector<picomath::number_t> xs(4096);
+    std::vector<picomath::number_t> out(xs.size());
+    for (size_t i = 0; i < xs.size(); i++) {
+        xs[i] = static_cast<picomath::number_t>(i);
+    }
+    while (state.KeepRunning()) {
+        benchmark::DoNotOptimize(expression.evalBatch(xs.size(), {{&x, xs.data()}}, out.data()));
+        benchmark::ClobberMemory();
+    }
+    state.SetItemsProcessed(static_cast<int64_t>(state.iterations() * xs.size()));
+}
+
+static void BM_rangeScreening(benchmark::State &state) // NOLINT google-runtime-references
+{
+    // Counts the rows above a threshold. With range checks, blocks whose bounds stay below it are skipped
+    picomath::PicoMath ctx;
+    auto &             x = ctx.addVariable("x");
+    auto &             y = ctx.addVariable("y");
+    y                    = 2.0;
+    auto                            expression = ctx.compileExpression("sqrt(x * x + y * y) * 2 + cos(x)");
+    std::vector<picomath::number_t> xs(4096);
+    std::vector<picomath::number_t> out(xs.size());
+    for (size_t i = 0; i < xs.size(); i++) {
+        xs[i] = static_cast<picomath::number_t>(i) / 16;
+    }
+    const size_t             block     = 256;
+    const picomath::number_t threshold = 500;
+    bool                     screen    = state.range(0) != 0;
+    while (state.KeepRunning()) {
+        size_t above = 0;
+        for (size_t start = 0; start < xs.size(); start += block) {
+            const auto *first = xs.data() + start;
+            if (screen) {
+                auto range = std::minmax_element(first, first + block);
+                if (expression.bound({{&x, {*range.first, *range.second}}}).high < threshold) {
+                    continue;
+                }
+            }
+            benchmark::DoNotOptimize(expression.evalBatch(block, {{&x, first}}, out.data()));
+            above += static_cast<size_t>(std::count_if(out.data(), out.data() + block,
+                                                       [threshold](picomath::number_t v) { return v > threshold; }));
+        }
+        benchmark::DoNotOptimize(above);
+    }
+    state.SetItemsProcessed(static_cast<int64_t>(state.iterations() * xs.size()));
+}
+
+static void BM_tieredExpression(benchmark::State &state) // NOLINT google-runtime-references
+{
+    picomath::PicoMath ctx;
+    ctx.addVariable("x") = 2.0;
+    ctx.addVariable("y") = 3.0;
+    ctx.addVariable("z") = 5.0;
+    ctx.addVariable("w") = 7.0;
+    picomath::TieredEvaluator tiered(ctx);
+    const char *              expression = "((((x-(y/(z*w)))/(((x-y)*z)-w))/((((x+y)*z)-w)-((x+y)-(z*w))))/"
+                             "(((((x-y)*z)-w)*((x+y)-(z/w)))*(((x+y)-(z*w))+((x/y)+(z+w)))))";
+    while (state.KeepRunning()) {
+        benchmark::DoNotOptimize(tiered.evalExpression(expression));
+        benchmark::ClobberMemory();
+    }
+}
+
+static void BM_reduction(benchmark::State &state) // NOLINT google-runtime-references
+{
+    picomath::PicoMath              ctx;
+    std::vector<picomath::number_t> a(1 << 20);
+    std::vector<picomath::number_t> b(a.size());
+    for (size_t i = 0; i < a.size(); i++) {
+        a[i] = static_cast<picomath::number_t>(i % 1000) / 7;
+        b[i] = static_cast<picomath::number_t>(i % 10);
+    }
+    ctx.addArray("a") = {a.data(), a.size()};
+    ctx.addArray("b") = {b.data(), b.size()};
+    ctx.setSummation(static_cast<picomath::Summation>(state.range(0)));
+    auto sum = ctx.compileExpression(state.range(1) == 0 ? "sum(a)" : "sum(a * b + 1)");
+    while (state.KeepRunning()) {
+        benchmark::DoNotOptimize(sum.eval());
+        benchmark::ClobberMemory();
+    }
+    state.SetItemsProcessed(state.iterations() * static_cast<int64_t>(a.size()));
+}
+
+static void BM_generatedExpression(benchmark::State &state) // NOLINT google-runtime-references
+{
+    // Machine generated formulas: long identifiers, long literals and a lot of indentation
+    picomath::PicoMath ctx;
+    std::string        expression;
+    for (int i = 0; i < 100; i++) {
+        std::string name = "measurement_channel_" + std::string(1 + i % 26, static_cast<char>('a' + i % 26));
+        ctx.addVariable(name) = i;
+        expression += "\n                (" + name + "    *    1234567.891011   )    +";
+    }
+    expression += "\n                0\n";
+    while (state.KeepRunning()) {
+        benchmark::DoNotOptimize(ctx.evalExpression(expression.c_str()));
+        benchmark::ClobberMemory();
+    }
+    state.SetBytesProcessed(state.iterations() * static_cast<int64_t>(expression.size()));
+}
+
 static void BM_multiExpression(benchmark::State &state) // NOLINT google-runtime-references
 {
     picomath::PicoMath ctx;
@@ -71,6 +319,29 @@ static void BM_multiExpression(benchmark::State &state) // NOLINT google-runtime
     }
 }
 
+static void BM_contextConstruction(benchmark::State &state) // NOLINT google-runtime-references
+{
+    while (state.KeepRunning()) {
+        picomath::PicoMath ctx;
+        benchmark::DoNotOptimize(ctx.evalExpression("sqrt(pi)"));
+        benchmark::ClobberMemory();
+    }
+}
+
+static void BM_contextFork(benchmark::State &state) // NOLINT google-runtime-references
+{
+    picomath::PicoMath base;
+    for (int i = 0; i < 100; i++) {
+        base.addVariable("v" + std::to_string(i)) = i;
+    }
+    while (state.KeepRunning()) {
+        picomath::PicoMath ctx = base.fork();
+        ctx.addVariable("x")   = 2.0;
+        benchmark::DoNotOptimize(ctx.evalExpression("v99 * x"));
+        benchmark::ClobberMemory();
+    }
+}
+
 auto main(int argc, char *argv[]) -> int {
     benchmark::RegisterBenchmark("Baseline tolower", // NOLINT clang-analyzer-cplusplus.NewDeleteLeaks
                                  BM_baseLine);
@@ -82,6 +353,40 @@ auto main(int argc, char *argv[]) -> int {
                                  BM_customUnit);
     benchmark::RegisterBenchmark("Complex expression", // NOLINT clang-analyzer-cplusplus.NewDeleteLeaks
                                  BM_complexExpression);
+    benchmark::RegisterBenchmark("Complex expression with budget", // NOLINT clang-analyzer-cplusplus.NewDeleteLeaks
+                                 BM_budgetedExpression);
+    benchmark::RegisterBenchmark("Compiled complex expression", // NOLINT clang-analyzer-cplusplus.NewDeleteLeaks
+                                 BM_compiledExpression);
+    benchmark::RegisterBenchmark("Tiered complex expression", // NOLINT clang-analyzer-cplusplus.NewDeleteLeaks
+                                 BM_tieredExpression);
+    benchmark::RegisterBenchmark("Pure function cache", // NOLINT clang-analyzer-cplusplus.NewDeleteLeaks
+                                 BM_pureFunctionCache)
+        ->Arg(0)
+        ->Arg(1);
+    benchmark::RegisterBenchmark("List", // NOLINT clang-analyzer-cplusplus.NewDeleteLeaks
+                                 BM_list);
+    benchmark::RegisterBenchmark("Compiled list", // NOLINT clang-analyzer-cplusplus.NewDeleteLeaks
+                                 BM_compiledList);
+    benchmark::RegisterBenchmark("2000 independent rules", // NOLINT clang-analyzer-cplusplus.NewDeleteLeaks
+                                 BM_independentRules);
+    benchmark::RegisterBenchmark("2000 rules in a rule set", // NOLINT clang-analyzer-cplusplus.NewDeleteLeaks
+                                 BM_ruleSet);
+    benchmark::RegisterBenchmark("Batch evaluation", // NOLINT clang-analyzer-cplusplus.NewDeleteLeaks
+                                 BM_batchEvaluation);
+    benchmark::RegisterBenchmark("Threshold with range checks", // NOLINT clang-analyzer-cplusplus.NewDeleteLeaks
+                                 BM_rangeScreening)
+        ->Arg(0)
+        ->Arg(1);
+    benchmark::RegisterBenchmark("Context construction", // NOLINT clang-analyzer-cplusplus.NewDeleteLeaks
+                                 BM_contextConstruction);
+    benchmark::RegisterBenchmark("Forked context", // NOLINT clang-analyzer-cplusplus.NewDeleteLeaks
+                                 BM_contextFork);
+    benchmark::RegisterBenchmark("Reduction of 1M elements", // NOLINT clang-analyzer-cplusplus.NewDeleteLeaks
+                                 BM_reduction)
+        ->ArgNames({"summation", "fused"})
+        ->ArgsProduct({{0, 1, 2}, {0, 1}});
+    benchmark::RegisterBenchmark("Generated expression", // NOLINT clang-analyzer-cplusplus.NewDeleteLeaks
+                                 BM_generatedExpression);
     benchmark::RegisterBenchmark("Multiexpression", // NOLINT clang-analyzer-cplusplus.NewDeleteLeaks
                                  BM_multiExpression);
 
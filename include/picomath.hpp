@@ -11,13 +11,40 @@
 #ifndef PICOMATH_HPP
 #define PICOMATH_HPP
 
+#include <algorithm>
 #include <array>
+#include <chrono>
 #include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <initializer_list>
 #include <limits>
 #include <map>
 #include <memory>
+#include <optional>
 #include <string>
 #include <string_view>
+#include <tuple>
+#include <vector>
+
+// Define PM_NO_SIMD to scan expressions one character at a time. Runs longer than one block are
+// scanned with aligned vector loads, which can read past the end of the string but never past its
+// page. Address, thread and memory sanitizers report these reads, so the vector scanner is disabled
+// when one of them is enabled. Define PM_NO_SIMD when running under valgrind too
+#if !defined(PM_NO_SIMD) && (defined(__SANITIZE_ADDRESS__) || defined(__SANITIZE_THREAD__))
+#define PM_NO_SIMD
+#elif !defined(PM_NO_SIMD) && defined(__has_feature)
+#if __has_feature(address_sanitizer) || __has_feature(thread_sanitizer) || __has_feature(memory_sanitizer)
+#define PM_NO_SIMD
+#endif
+#endif
+#if !defined(PM_NO_SIMD) && defined(__AVX2__)
+#include <immintrin.h>
+#define PM_SIMD_WIDTH 32
+#elif !defined(PM_NO_SIMD) && defined(__SSE2__)
+#include <emmintrin.h>
+#define PM_SIMD_WIDTH 16
+#endif
 
 namespace picomath {
 
@@ -31,12 +58,28 @@ namespace picomath {
 #define PM_MAX_ARGUMENTS 8
 #endif
 
+// Number of rows evaluated together by CompiledExpression::evalBatch
+#ifndef PM_BATCH_SIZE
+#define PM_BATCH_SIZE 256
+#endif
+
+// Number of operations between two checks of the deadline of a Budget
+#ifndef PM_DEADLINE_INTERVAL
+#define PM_DEADLINE_INTERVAL 64
+#endif
+
 #define PM_LIKELY(x)   __builtin_expect((x), 1)
 #define PM_UNLIKELY(x) __builtin_expect((x), 0)
 #define PM_INLINE      inline __attribute__((always_inline))
 
 class Result;
-class Expression;
+class Scanner;
+template <bool budgeted>
+class BasicExpression;
+using Expression = BasicExpression<false>;
+class CompiledExpression;
+class Compiler;
+class RuleSet;
 class PicoMath;
 
 #ifdef PM_USE_FLOAT
@@ -54,19 +97,53 @@ using argument_list_t        = std::array<number_t, PM_MAX_ARGUMENTS>;
 using error_t                = std::string;
 using custom_function_many_t = Result (*)(size_t argc, const argument_list_t &list);
 using custom_function_1_t    = number_t (*)(number_t);
+using custom_function_bulk_t = Result (*)(size_t argc, const number_t *const *columns, size_t rows, number_t *out);
+
+/**
+ * @brief Reason of a failed evaluation
+ */
+enum class ErrorKind
+{
+    None           = 0,
+    Invalid        = 1, // Syntax errors, unknown identifiers and errors returned by custom functions
+    BudgetExceeded = 2  // A limit of the Budget was exceeded, the evaluation was aborted
+};
+
+/**
+ * @brief Limits of an evaluation, for expressions coming from untrusted sources.
+ * Every limit is disabled by default. Budgets only apply to direct evaluation: compiled
+ * expressions and lists of expressions ignore them, use CompiledExpression::getCost to
+ * check a compiled expression before running it.
+ */
+struct Budget {
+    // Characters of the expression, checked before parsing it
+    size_t maxLength{std::numeric_limits<size_t>::max()};
+    // Numbers, variables, function calls, unary operators and parenthesized groups evaluated
+    size_t maxOperations{std::numeric_limits<size_t>::max()};
+    // Nesting of parentheses, unary operators and function arguments
+    size_t maxDepth{std::numeric_limits<size_t>::max()};
+    // Checked every PM_DEADLINE_INTERVAL operations and after every custom function call
+    std::chrono::steady_clock::time_point deadline{std::chrono::steady_clock::time_point::max()};
+};
 
 class Result {
-    friend class Expression;
+    template <bool>
+    friend class BasicExpression;
+
+    struct Error {
+        error_t   description;
+        ErrorKind kind;
+    };
 
-    number_t                 result;
-    std::unique_ptr<error_t> error;
+    number_t               result;
+    std::unique_ptr<Error> error;
 
   public:
     Result(number_t value = 0) noexcept : result(value), error() { // NOLINT
     }
 
-    Result(std::string &&description) noexcept
-        : result(0), error(std::make_unique<error_t>(std::move(description))) { // NOLINT
+    Result(std::string &&description, ErrorKind kind = ErrorKind::Invalid) noexcept
+        : result(0), error(std::make_unique<Error>(Error{std::move(description), kind})) { // NOLINT
     }
 
     [[nodiscard]] auto isError() const -> bool {
@@ -78,7 +155,15 @@ class Result {
     }
 
     [[nodiscard]] auto getError() const -> const char * {
-        return error->c_str();
+        return error->description.c_str();
+    }
+
+    [[nodiscard]] auto getErrorKind() const -> ErrorKind {
+        return error == nullptr ? ErrorKind::None : error->kind;
+    }
+
+    [[nodiscard]] auto isBudgetExceeded() const -> bool {
+        return getErrorKind() == ErrorKind::BudgetExceeded;
     }
 
     [[nodiscard]] auto getResult() const -> number_t {
@@ -86,273 +171,3186 @@ class Result {
     }
 };
 
-#define PM_FUNCTION_2(fun)                                                                                             \
-    [](size_t argc, const argument_list_t &args) -> Result {                                                           \
-        if (argc != 2) {                                                                                               \
-            return {"Two arguments needed"};                                                                           \
-        }                                                                                                              \
-        return fun(args[0], args[1]);                                                                                  \
-    }
+/**
+ * @brief Declares whether a custom function always returns the same value for the same arguments.
+ * Pure functions can be deduplicated when compiling and their results can be cached.
+ */
+enum class Purity
+{
+    Impure = 0,
+    Pure   = 1
+};
 
-class PicoMath {
-    friend Expression;
+/**
+ * @brief Hit and miss counters of a function result cache
+ */
+struct FunctionCacheStats {
+    size_t capacity{0};
+    size_t hits{0};
+    size_t misses{0};
+
+    [[nodiscard]] auto hitRate() const -> double {
+        size_t lookups = hits + misses;
+        return lookups == 0 ? 0.0 : static_cast<double>(hits) / static_cast<double>(lookups);
+    }
+};
 
-    struct Function {
-        enum Type
-        {
-            FunctionMany = 0,
-            Function1    = 1
-        } type;
-        custom_function_many_t many;
-        custom_function_1_t    f1;
+/**
+ * @brief Bounded, direct mapped cache of the results of a pure function.
+ * Arguments are compared bitwise, so `-0` and `0` are different keys and NaNs can be cached.
+ */
+class FunctionCache {
+    struct Entry {
+        size_t          argc{0};
+        argument_list_t args{};
+        number_t        result{0};
+        bool            used{false};
     };
 
-    std::map<std::string, number_t, std::less<>> variables{};
-    std::map<std::string, number_t, std::less<>> units{};
-    std::map<std::string, Function, std::less<>> functions{};
+    std::vector<Entry> entries;
+    FunctionCacheStats stats{};
+
+    [[nodiscard]] auto slot(size_t argc, const argument_list_t &args) const -> size_t {
+        uint64_t hash = 14695981039346656037ULL ^ argc;
+        for (size_t i = 0; i < argc; i++) {
+            uint64_t bits = 0;
+            std::memcpy(&bits, &args[i], sizeof(number_t));
+            hash = (hash ^ bits) * 1099511628211ULL;
+        }
+        // Floating point values differ mostly in their high bits, mix them into the low ones
+        hash ^= hash >> 33U;
+        hash *= 0xff51afd7ed558ccdULL;
+        hash ^= hash >> 33U;
+        return static_cast<size_t>(hash) & (entries.size() - 1);
+    }
 
   public:
+    explicit FunctionCache(size_t capacity) : entries() {
+        size_t size = 1;
+        while (size < capacity) {
+            size <<= 1U;
+        }
+        entries.resize(size);
+        stats.capacity = size;
+    }
+
+    auto find(size_t argc, const argument_list_t &args, number_t *outResult) -> bool {
+        const Entry &entry = entries[slot(argc, args)];
+        if (entry.used && entry.argc == argc &&
+            std::memcmp(entry.args.data(), args.data(), argc * sizeof(number_t)) == 0) {
+            stats.hits++;
+            *outResult = entry.result;
+            return true;
+        }
+        stats.misses++;
+        return false;
+    }
+
+    auto store(size_t argc, const argument_list_t &args, number_t result) -> void {
+        Entry &entry = entries[slot(argc, args)];
+        entry.argc   = argc;
+        entry.args   = args;
+        entry.result = result;
+        entry.used   = true;
+    }
+
+    [[nodiscard]] auto getStats() const -> const FunctionCacheStats & {
+        return stats;
+    }
+};
+
+/**
+ * @brief Contiguous buffer owned by the caller, bound to an array variable
+ */
+struct ArrayView {
+    const number_t *data{nullptr};
+    size_t          size{0};
+};
+
+/**
+ * @brief How reductions add up the elements of arrays
+ */
+enum class Summation
+{
+    Fast     = 0, // Independent partial sums that are vectorized
+    Pairwise = 1, // Partial sums added in a balanced tree, the error grows with log(n)
+    Kahan    = 2  // Compensated partial sums, the error doesn't grow with n
+};
+
+/**
+ * @brief Closed range of values, used to bound the results of compiled expressions.
+ * Bounds can be infinite. `maybeNaN` is set when the value can also be NaN, e.g. `sqrt(x)` when `x`
+ * can be negative.
+ */
+struct Interval {
+    number_t low{-std::numeric_limits<number_t>::infinity()};
+    number_t high{std::numeric_limits<number_t>::infinity()};
+    bool     maybeNaN{false};
+
+    static auto point(number_t value) -> Interval {
+        return std::isnan(value) ? unbounded() : Interval{value, value, false};
+    }
+
     /**
-     * @brief Adds a variable to the parsing context.
-     * PicoMath returns a reference to entry inside the map of variables, that can be changed
-     * during multiple evaluations
-     *
-     * @param name Name of the variable
-     * @return number_t& Reference to variable's value
+     * @brief Any value, including NaN
      */
-    auto addVariable(const std::string &name) -> number_t & {
-        return variables[name];
+    static auto unbounded() -> Interval {
+        return {-std::numeric_limits<number_t>::infinity(), std::numeric_limits<number_t>::infinity(), true};
+    }
+
+    [[nodiscard]] auto contains(number_t value) const -> bool {
+        return low <= value && value <= high;
     }
 
     /**
-     * @brief Adds a scale unit to the parsing context
-     * PicoMath returns a reference to entry inside the map of variables, that can be changed
-     * during multiple evaluations.
-     *
-     * @param name Name of the unit
-     * @return number_t& Reference to the unit's scale value
+     * @brief Checks whether the interval holds a single value, that can't be NaN
      */
-    auto addUnit(const std::string &name) -> number_t & {
-        return units[name];
+    [[nodiscard]] auto isPoint() const -> bool {
+        return low >= high && !maybeNaN;
+    }
+
+    [[nodiscard]] auto isFinite() const -> bool {
+        return std::isfinite(low) && std::isfinite(high);
     }
 
     /**
-     * @brief Adds a custom function to the parsing context
-     * This overload allows the user to pass a function that can handle multiple arguments.
+     * @brief Moves finite bounds outwards, to cover functions that are not correctly rounded
      *
-     * @param name Name of the function
-     * @param func Function pointer
+     * @param ulps Units in the last place added to each bound
      */
-    auto addFunction(const std::string &name, custom_function_many_t func) -> void {
-        auto &function = functions[name];
-        function.type  = Function::Type::FunctionMany;
-        function.many  = func;
+    [[nodiscard]] auto widened(int ulps) const -> Interval {
+        if (std::isnan(low) || std::isnan(high)) {
+            return unbounded();
+        }
+        Interval result = *this;
+        for (int i = 0; i < ulps; i++) {
+            result.low  = std::nextafter(result.low, -std::numeric_limits<number_t>::infinity());
+            result.high = std::nextafter(result.high, std::numeric_limits<number_t>::infinity());
+        }
+        return result;
     }
 
     /**
-     * @brief Adds a custom function to the parsing context
-     *
-     * @param name Name of the function
-     * @param func Function pointer
+     * @brief Bounds of a non-decreasing function defined on [domainLow, domainHigh]. Values
+     * outside of the domain give NaN
      */
-    auto addFunction(const std::string &name, custom_function_1_t func) -> void {
-        auto &function = functions[name];
-        function.type  = Function::Type::Function1;
-        function.f1    = func;
+    template <typename Function>
+    static auto increasing(const Interval &x, Function f, int ulps = 0,
+                           number_t domainLow  = -std::numeric_limits<number_t>::infinity(),
+                           number_t domainHigh = std::numeric_limits<number_t>::infinity()) -> Interval {
+        if (x.high < domainLow || x.low > domainHigh) {
+            return unbounded();
+        }
+        Interval result{f(std::max(x.low, domainLow)), f(std::min(x.high, domainHigh)),
+                        x.maybeNaN || x.low < domainLow || x.high > domainHigh};
+        return result.widened(ulps);
     }
 
-    PicoMath() {
-        // Constants
-        addVariable("pi") = static_cast<number_t>(M_PI);
-        addVariable("e")  = static_cast<number_t>(M_E);
+    /**
+     * @brief Bounds of a non-increasing function defined on [domainLow, domainHigh]
+     */
+    template <typename Function>
+    static auto decreasing(const Interval &x, Function f, int ulps = 0,
+                           number_t domainLow  = -std::numeric_limits<number_t>::infinity(),
+                           number_t domainHigh = std::numeric_limits<number_t>::infinity()) -> Interval {
+        if (x.high < domainLow || x.low > domainHigh) {
+            return unbounded();
+        }
+        Interval result{f(std::min(x.high, domainHigh)), f(std::max(x.low, domainLow)),
+                        x.maybeNaN || x.low < domainLow || x.high > domainHigh};
+        return result.widened(ulps);
+    }
 
-        // Built-in functions
-        addFunction("abs", std::abs);
-        addFunction("ceil", std::ceil);
-        addFunction("floor", std::floor);
-        addFunction("round", std::round);
-        addFunction("ln", std::log);
-        addFunction("log", std::log10);
-        addFunction("cos", std::cos);
-        addFunction("sin", std::sin);
-        addFunction("acos", std::acos);
-        addFunction("asin", std::asin);
-        addFunction("cosh", std::cosh);
-        addFunction("sinh", std::sinh);
-        addFunction("tan", std::tan);
-        addFunction("tanh", std::tanh);
-        addFunction("sqrt", std::sqrt);
-        addFunction("atan2", PM_FUNCTION_2(std::atan2));
-        addFunction("pow", PM_FUNCTION_2(std::pow));
-        addFunction("min", [](size_t argc, const argument_list_t &args) -> Result {
-            number_t result{std::numeric_limits<number_t>::max()};
-            size_t   i = 0;
-            while (i < argc) {
-                result = std::min(args[i], result);
-                i++;
-            }
-            return result;
-        });
-        addFunction("max", [](size_t argc, const argument_list_t &args) -> Result {
-            number_t result{std::numeric_limits<number_t>::min()};
-            size_t   i = 0;
-            while (i < argc) {
-                result = std::max(args[i], result);
-                i++;
+    /**
+     * @brief Smallest interval containing every candidate value. Used for functions that reach their
+     * extremes at a known set of points
+     */
+    static auto hull(std::initializer_list<number_t> values, bool maybeNaN) -> Interval {
+        Interval result{std::numeric_limits<number_t>::infinity(), -std::numeric_limits<number_t>::infinity(),
+                        maybeNaN};
+        for (number_t value : values) {
+            if (std::isnan(value)) {
+                return unbounded();
             }
+            result.low  = std::min(result.low, value);
+            result.high = std::max(result.high, value);
+        }
+        return result;
+    }
+
+    // Operations are evaluated with the same rounding as the program, and rounding is monotonic,
+    // so the bounds contain every computed result
+
+    friend auto operator-(const Interval &x) -> Interval {
+        return {-x.high, -x.low, x.maybeNaN};
+    }
+
+    friend auto operator+(const Interval &a, const Interval &b) -> Interval {
+        constexpr number_t infinity = std::numeric_limits<number_t>::infinity();
+        constexpr number_t largest  = std::numeric_limits<number_t>::max();
+        // inf - inf is the only way to get NaN
+        bool     nan = a.maybeNaN || b.maybeNaN || (a.low < -largest && b.high > largest) ||
+                   (a.high > largest && b.low < -largest);
+        number_t low  = a.low + b.low;
+        number_t high = a.high + b.high;
+        return {std::isnan(low) ? -infinity : low, std::isnan(high) ? infinity : high, nan};
+    }
+
+    friend auto operator-(const Interval &a, const Interval &b) -> Interval {
+        return a + -b;
+    }
+
+    friend auto operator*(const Interval &a, const Interval &b) -> Interval {
+        // 0 * inf is NaN, the products around it are zero or tend to it
+        bool nan = a.maybeNaN || b.maybeNaN || (a.contains(0) && !b.isFinite()) || (b.contains(0) && !a.isFinite());
+        auto product = [](number_t x, number_t y) {
+            number_t p = x * y;
+            return std::isnan(p) ? 0 : p;
+        };
+        Interval result = hull({product(a.low, b.low), product(a.low, b.high), product(a.high, b.low),
+                                product(a.high, b.high)},
+                               nan);
+        return result;
+    }
+
+    friend auto operator/(const Interval &a, const Interval &b) -> Interval {
+        if (b.contains(0) || (!a.isFinite() && !b.isFinite())) {
+            Interval result = unbounded();
+            result.maybeNaN = a.maybeNaN || b.maybeNaN || a.contains(0) || !a.isFinite() || !b.isFinite();
             return result;
-        });
+        }
+        return hull({a.low / b.low, a.low / b.high, a.high / b.low, a.high / b.high}, a.maybeNaN || b.maybeNaN);
+    }
+};
+
+using interval_function_t = Interval (*)(size_t argc, const Interval *args);
+
+#define PM_FUNCTION_2(fun)                                                                                             \
+    [](size_t argc, const argument_list_t &args) -> Result {                                                           \
+        if (argc != 2) {                                                                                               \
+            return {"Two arguments needed"};                                                                           \
+        }                                                                                                              \
+        return fun(args[0], args[1]);                                                                                  \
     }
 
-    /**
-     * @brief Evaluates the expression and returns a value or an error if the expression is invalid
-     *
-     * @param expression Expression to evaluate
-     * @return Result Result containing the result value or an error
-     */
-    auto evalExpression(const char *expression) -> Result;
+class PicoMath {
+    template <bool>
+    friend class BasicExpression;
+    friend CompiledExpression;
+    friend Compiler;
+
+    struct Function {
+        enum Type
+        {
+            FunctionMany = 0,
+            Function1    = 1,
+            FunctionBulk = 2
+        } type{FunctionMany};
+        custom_function_many_t         many{};
+        custom_function_1_t            f1{};
+        custom_function_bulk_t         bulk{};
+        Purity                         purity{Purity::Impure};
+        std::unique_ptr<FunctionCache> cache{};
+        interval_function_t            interval{}; // Bounds of the result, used by interval analysis
+
+        Function()                = default;
+        Function(Function &&)     = default;
+        auto operator=(Function &&) -> Function & = default;
+        ~Function()                               = default;
+
+        /**
+         * @brief Copies the function with an empty cache of the same capacity, caches are never shared
+         */
+        Function(const Function &other)
+            : type(other.type), many(other.many), f1(other.f1), bulk(other.bulk), purity(other.purity),
+              cache(other.cache == nullptr ? nullptr
+                                           : std::make_unique<FunctionCache>(other.cache->getStats().capacity)),
+              interval(other.interval) {
+        }
+
+        auto operator=(const Function &other) -> Function & {
+            if (this != &other) {
+                Function copy(other);
+                *this = std::move(copy);
+            }
+            return *this;
+        }
+
+        auto invoke(size_t argc, const argument_list_t &args) const -> Result {
+            if (type == Type::Function1) {
+                if (PM_UNLIKELY(argc != 1)) {
+                    return {"One argument required"};
+                }
+                return {f1(args[0])};
+            }
+            if (type == Type::FunctionBulk) {
+                std::array<const number_t *, PM_MAX_ARGUMENTS> columns{};
+                for (size_t i = 0; i < argc; i++) {
+                    columns[i] = &args[i];
+                }
+                number_t out = 0;
+                Result   ret = bulk(argc, columns.data(), 1, &out);
+                if (PM_UNLIKELY(ret.isError())) {
+                    return ret;
+                }
+                return {out};
+            }
+            return many(argc, args);
+        }
+
+        auto call(size_t argc, const argument_list_t &args) const -> Result {
+            if (PM_LIKELY(cache == nullptr)) {
+                return invoke(argc, args);
+            }
+            number_t cached;
+            if (cache->find(argc, args, &cached)) {
+                return {cached};
+            }
+            Result ret = invoke(argc, args);
+            if (ret.isOk()) {
+                cache->store(argc, args, ret.getResult());
+            }
+            return ret;
+        }
+
+        /**
+         * @brief Evaluates the function for a block of rows. Scalar functions are called once per row.
+         */
+        auto callBulk(size_t argc, const number_t *const *columns, size_t rows, number_t *out) const -> Result {
+            if (type == Type::FunctionBulk) {
+                return bulk(argc, columns, rows, out);
+            }
+            if (type == Type::Function1 && PM_LIKELY(cache == nullptr)) {
+                if (PM_UNLIKELY(argc != 1)) {
+                    return {"One argument required"};
+                }
+                const number_t *column = columns[0];
+                for (size_t row = 0; row < rows; row++) {
+                    out[row] = f1(column[row]);
+                }
+                return {};
+            }
+            argument_list_t args{};
+            for (size_t row = 0; row < rows; row++) {
+                for (size_t i = 0; i < argc; i++) {
+                    args[i] = columns[i][row];
+                }
+                Result ret = call(argc, args);
+                if (PM_UNLIKELY(ret.isError())) {
+                    return ret;
+                }
+                out[row] = ret.getResult();
+            }
+            return {};
+        }
+    };
+
+    template <typename Value>
+    using Table = std::map<std::string, Value, std::less<>>;
+
+    template <typename Value>
+    using Entry = std::pair<const std::string, Value>;
 
     /**
-     * @brief Creates a Expression that can be used to evaluate multiple expression separated by commas.
-     *
-     * @param expression MultiExpression to evaluate
-     * @return Expression Expression object maintaining the context of the multi-evaluation
+     * @brief Definitions added to a context. Lookups go through the layer of the context and then
+     * through the chain of parents, which are shared and never change their structure
      */
-    auto evalMultiExpression(const char *expression) -> Expression;
-};
+    struct Layer {
+        Table<number_t>              variables{};
+        Table<number_t>              units{};
+        Table<Function>              functions{};
+        Table<ArrayView>             arrays{};
+        std::shared_ptr<const Layer> parent{};
+    };
 
-class Expression {
-    friend PicoMath;
+    // Own additions, allocated on the first one
+    std::shared_ptr<Layer> overlay{};
+    // Built-in definitions, or the definitions of the context this one was forked from
+    std::shared_ptr<const Layer> parent{};
+    Summation                    summation{Summation::Fast};
 
-    const PicoMath &context;
-    const char *    originalStr{};
-    const char *    str{};
+    struct Bare {};
 
-    Expression(const PicoMath &picomathContext, const char *expression)
-        : context(picomathContext), originalStr(expression), str(expression) {
+    explicit PicoMath(Bare /*unused*/) {
     }
 
-    auto evalSingle() -> Result {
-        Result ret = evalExpression();
-        consumeSpace();
-        if (PM_LIKELY(isEOF())) {
-            return ret;
+    template <typename Value>
+    PM_INLINE auto find(Table<Value> Layer::*table, std::string_view name) const -> const Entry<Value> * {
+        if (overlay != nullptr) {
+            auto f = (overlay.get()->*table).find(name);
+            if (f != (overlay.get()->*table).end()) {
+                return &*f;
+            }
         }
-        return generateError("Invalid characters after expression");
+        for (const Layer *layer = parent.get(); layer != nullptr; layer = layer->parent.get()) {
+            auto f = (layer->*table).find(name);
+            if (f != (layer->*table).end()) {
+                return &*f;
+            }
+        }
+        return nullptr;
+    }
+
+    PM_INLINE auto findVariable(std::string_view name) const -> const Entry<number_t> * {
+        return find(&Layer::variables, name);
+    }
+
+    PM_INLINE auto findUnit(std::string_view name) const -> const Entry<number_t> * {
+        return find(&Layer::units, name);
+    }
+
+    PM_INLINE auto findFunction(std::string_view name) const -> const Entry<Function> * {
+        return find(&Layer::functions, name);
+    }
+
+    PM_INLINE auto findArray(std::string_view name) const -> const Entry<ArrayView> * {
+        return find(&Layer::arrays, name);
     }
 
-  public:
     /**
-     * @brief Evaluates the next expression in the multi expression context
-     *
-     * @param outResult Result of the evaluation
-     * @return true The evaluation succeeded and the outResult parameter contains a valid output value.
-     * @return false There are no more expressions to evaluate
+     * @brief Checks whether an identifier that is not a function refers to an array
      */
-    auto evalNext(Result *outResult) -> bool {
-        consumeSpace();
-        if (isEOF()) {
-            return false;
+    [[nodiscard]] auto isArray(std::string_view name) const -> bool {
+        return findVariable(name) == nullptr && findArray(name) != nullptr;
+    }
+
+    [[nodiscard]] auto hasArrays() const -> bool {
+        if (overlay != nullptr && !overlay->arrays.empty()) {
+            return true;
         }
-        *outResult = evalExpression();
-        consumeSpace();
-        if (peek() == ',') {
-            consume();
-            consumeSpace();
+        for (const Layer *layer = parent.get(); layer != nullptr; layer = layer->parent.get()) {
+            if (!layer->arrays.empty()) {
+                return true;
+            }
         }
-        return true;
+        return false;
     }
 
-  private:
-    auto generateError(const char *error, std::string_view identifier = {}) const -> Result {
-        std::string out = "In character " + std::to_string(static_cast<int>(str - originalStr - 1)) + ": ";
-        out += error;
-        if (identifier.empty()) {
-            out += " found: ";
-            out += isEOF() ? "End of string" : str;
-        } else {
-            out += ' ';
-            out += '`';
-            out += identifier;
-            out += '`';
+    auto ownLayer() -> Layer & {
+        if (overlay == nullptr) {
+            overlay = std::make_shared<Layer>();
         }
-        return out;
+        return *overlay;
     }
 
-    PM_INLINE auto evalExpression() -> Result {
-        consumeSpace();
-        if (PM_UNLIKELY(isEOF())) {
-            return generateError("Unexpected end of the string");
+    /**
+     * @brief Adds an entry to the own layer, starting with the inherited value if there is one
+     */
+    template <typename Value>
+    auto addValue(Table<Value> Layer::*table, const std::string &name) -> Value & {
+        Table<Value> &own = ownLayer().*table;
+        auto          f   = own.find(name);
+        if (f != own.end()) {
+            return f->second;
         }
-        return parseAddition();
+        const Entry<Value> *inherited = find(table, name);
+        return own.emplace(name, inherited == nullptr ? Value{} : inherited->second).first->second;
     }
 
-    PM_INLINE auto consume() -> char {
-        return *str++;
+    auto addFunction(const std::string &name, Function::Type type, Purity purity) -> Function & {
+        auto &function    = ownLayer().functions[name];
+        function.type     = type;
+        function.purity   = purity;
+        function.cache    = nullptr;
+        function.interval = nullptr;
+        return function;
+    }
+
+    /**
+     * @brief Returns the function from the own layer, copying an inherited one first
+     */
+    auto ownFunction(const Entry<Function> &inherited) -> Function & {
+        auto own = ownLayer().functions.find(inherited.first);
+        if (own != overlay->functions.end()) {
+            return own->second;
+        }
+        Function &function = addFunction(inherited.first, inherited.second.type, inherited.second.purity);
+        function.many      = inherited.second.many;
+        function.f1        = inherited.second.f1;
+        function.bulk      = inherited.second.bulk;
+        function.interval  = inherited.second.interval;
+        return function;
+    }
+
+    /**
+     * @brief Shared layer with the built-in constants and functions, created on first use
+     */
+    static auto builtins() -> const std::shared_ptr<const Layer> & {
+        static const std::shared_ptr<const Layer> layer = [] {
+            PicoMath context{Bare{}};
+            context.addBuiltins();
+            return std::shared_ptr<const Layer>(std::move(context.overlay));
+        }();
+        return layer;
+    }
+
+    /**
+     * @brief Interval rules of the built-in functions.
+     * Functions of the standard library that are not correctly rounded widen their bounds by a few ulps.
+     */
+    struct Bounds {
+        static constexpr number_t pi       = static_cast<number_t>(M_PI);
+        static constexpr number_t infinity = std::numeric_limits<number_t>::infinity();
+
+        /**
+         * @brief Checks whether the interval can contain `offset + k * period` for an integer k.
+         * Multiples of a rounded period drift from the exact ones, so the check is made with a margin
+         * and only answers false when the interval is certainly clear of every point.
+         */
+        static auto reaches(const Interval &x, number_t offset, number_t period) -> bool {
+            number_t margin = static_cast<number_t>(1e-6) * std::max(number_t{1}, std::abs(x.low));
+            number_t k      = std::ceil((x.low - margin - offset) / period);
+            return offset + k * period <= x.high + margin;
+        }
+
+        /**
+         * @brief Bounds of a periodic function with extremes of -1 and 1
+         */
+        template <typename Function>
+        static auto wave(const Interval &x, Function f, number_t maxAt, number_t minAt) -> Interval {
+            if (!x.isFinite() || x.high - x.low >= 2 * pi || std::abs(x.low) > number_t{1 << 20} ||
+                std::abs(x.high) > number_t{1 << 20}) {
+                return {-1, 1, x.maybeNaN || !x.isFinite()};
+            }
+            Interval result = Interval::hull({f(x.low), f(x.high)}, x.maybeNaN).widened(2);
+            if (reaches(x, maxAt, 2 * pi)) {
+                result.high = 1;
+            }
+            if (reaches(x, minAt, 2 * pi)) {
+                result.low = -1;
+            }
+            return {std::max(result.low, number_t{-1}), std::min(result.high, number_t{1}), result.maybeNaN};
+        }
+
+        static auto abs(size_t argc, const Interval *args) -> Interval {
+            if (argc != 1) {
+                return Interval::unbounded();
+            }
+            const Interval &x = args[0];
+            if (x.low >= 0) {
+                return x;
+            }
+            if (x.high <= 0) {
+                return -x;
+            }
+            return {0, std::max(-x.low, x.high), x.maybeNaN};
+        }
+
+        static auto ceil(size_t argc, const Interval *args) -> Interval {
+            return argc != 1 ? Interval::unbounded()
+                             : Interval::increasing(args[0], [](number_t v) { return std::ceil(v); });
+        }
+
+        static auto floor(size_t argc, const Interval *args) -> Interval {
+            return argc != 1 ? Interval::unbounded()
+                             : Interval::increasing(args[0], [](number_t v) { return std::floor(v); });
+        }
+
+        static auto round(size_t argc, const Interval *args) -> Interval {
+            return argc != 1 ? Interval::unbounded()
+                             : Interval::increasing(args[0], [](number_t v) { return std::round(v); });
+        }
+
+        static auto ln(size_t argc, const Interval *args) -> Interval {
+            return argc != 1 ? Interval::unbounded()
+                             : Interval::increasing(args[0], [](number_t v) { return std::log(v); }, 2, 0);
+        }
+
+        static auto log(size_t argc, const Interval *args) -> Interval {
+            return argc != 1 ? Interval::unbounded()
+                             : Interval::increasing(args[0], [](number_t v) { return std::log10(v); }, 2, 0);
+        }
+
+        static auto sqrt(size_t argc, const Interval *args) -> Interval {
+            return argc != 1 ? Interval::unbounded()
+                             : Interval::increasing(args[0], [](number_t v) { return std::sqrt(v); }, 0, 0);
+        }
+
+        static auto cos(size_t argc, const Interval *args) -> Interval {
+            return argc != 1 ? Interval::unbounded()
+                             : wave(args[0], [](number_t v) { return std::cos(v); }, 0, pi);
+        }
+
+        static auto sin(size_t argc, const Interval *args) -> Interval {
+            return argc != 1 ? Interval::unbounded()
+                             : wave(args[0], [](number_t v) { return std::sin(v); }, pi / 2, -pi / 2);
+        }
+
+        static auto tan(size_t argc, const Interval *args) -> Interval {
+            if (argc != 1) {
+                return Interval::unbounded();
+            }
+            const Interval &x = args[0];
+            if (!x.isFinite() || x.high - x.low >= pi || std::abs(x.low) > number_t{1 << 20} ||
+                std::abs(x.high) > number_t{1 << 20} || reaches(x, pi / 2, pi)) {
+                return {-infinity, infinity, x.maybeNaN || !x.isFinite()};
+            }
+            return Interval::increasing(x, [](number_t v) { return std::tan(v); }, 2);
+        }
+
+        static auto acos(size_t argc, const Interval *args) -> Interval {
+            return argc != 1 ? Interval::unbounded()
+                             : Interval::decreasing(args[0], [](number_t v) { return std::acos(v); }, 2, -1, 1);
+        }
+
+        static auto asin(size_t argc, const Interval *args) -> Interval {
+            return argc != 1 ? Interval::unbounded()
+                             : Interval::increasing(args[0], [](number_t v) { return std::asin(v); }, 2, -1, 1);
+        }
+
+        static auto cosh(size_t argc, const Interval *args) -> Interval {
+            if (argc != 1) {
+                return Interval::unbounded();
+            }
+            // Even function with its minimum at zero
+            Interval magnitude = abs(argc, args);
+            Interval result    = Interval::increasing(magnitude, [](number_t v) { return std::cosh(v); }, 2);
+            result.low         = std::max(result.low, number_t{1});
+            return result;
+        }
+
+        static auto sinh(size_t argc, const Interval *args) -> Interval {
+            return argc != 1 ? Interval::unbounded()
+                             : Interval::increasing(args[0], [](number_t v) { return std::sinh(v); }, 2);
+        }
+
+        static auto tanh(size_t argc, const Interval *args) -> Interval {
+            if (argc != 1) {
+                return Interval::unbounded();
+            }
+            Interval result = Interval::increasing(args[0], [](number_t v) { return std::tanh(v); }, 2);
+            return {std::max(result.low, number_t{-1}), std::min(result.high, number_t{1}), result.maybeNaN};
+        }
+
+        static auto atan2(size_t argc, const Interval *args) -> Interval {
+            if (argc != 2) {
+                return Interval::unbounded();
+            }
+            const Interval &y   = args[0];
+            const Interval &x   = args[1];
+            bool            nan = x.maybeNaN || y.maybeNaN;
+            // The angle jumps from pi to -pi across the negative x axis
+            if (x.low <= 0 && y.low <= 0 && y.high >= 0) {
+                return Interval{-pi, pi, nan}.widened(2);
+            }
+            return Interval::hull({std::atan2(y.low, x.low), std::atan2(y.low, x.high), std::atan2(y.high, x.low),
+                                   std::atan2(y.high, x.high)},
+                                  nan)
+                .widened(2);
+        }
+
+        static auto pow(size_t argc, const Interval *args) -> Interval {
+            if (argc != 2) {
+                return Interval::unbounded();
+            }
+            const Interval &x = args[0];
+            const Interval &y = args[1];
+            auto power = [&y](number_t base) { return std::pow(base, y.low); };
+            if (y.isPoint() && std::abs(y.low) < number_t{1 << 20} && std::floor(y.low) >= y.low) {
+                // Integer exponent, defined for negative bases
+                if (std::abs(y.low) < 1) {
+                    return Interval::point(1);
+                }
+                bool odd = std::abs(std::fmod(y.low, number_t{2})) > 0;
+                if (x.low <= 0 && x.high >= 0) {
+                    if (y.low < 0) {
+                        return {-infinity, infinity, x.maybeNaN};
+                    }
+                    if (odd) {
+                        return Interval::increasing(x, power, 2);
+                    }
+                    // Even powers only depend on the magnitude
+                    Interval result = Interval::increasing(abs(1, &x), power, 2);
+                    result.low      = std::max(result.low, number_t{0});
+                    return result;
+                }
+                // Odd powers keep the sign of negative bases, even powers flip their order
+                bool increasing = x.low > 0 ? y.low > 0 : odd == (y.low > 0);
+                return increasing ? Interval::increasing(x, power, 2) : Interval::decreasing(x, power, 2);
+            }
+            if (x.low < 0) {
+                return Interval::unbounded();
+            }
+            // Monotonic in each argument, so the extremes are at the corners
+            Interval result = Interval::hull({std::pow(x.low, y.low), std::pow(x.low, y.high), std::pow(x.high, y.low),
+                                              std::pow(x.high, y.high)},
+                                             x.maybeNaN || y.maybeNaN)
+                                  .widened(2);
+            if (x.low <= 0 && y.low < 0) {
+                // Zero raised to a negative exponent: infinity for +0, and for -0 minus infinity when
+                // the exponent is an odd integer. The corners only saw one of the two zeros
+                result.low  = -infinity;
+                result.high = infinity;
+            }
+            return result;
+        }
+
+        /**
+         * @brief Bounds of min and max, which start from `initial` and skip arguments compared
+         * with a NaN. An argument that can be NaN leaves the result anywhere between the extremes.
+         */
+        template <typename Select>
+        static auto extreme(size_t argc, const Interval *args, number_t initial, Select select) -> Interval {
+            Interval result = Interval::point(initial);
+            bool     nan    = false;
+            for (size_t i = 0; i < argc; i++) {
+                nan = nan || args[i].maybeNaN;
+            }
+            for (size_t i = 0; i < argc; i++) {
+                if (nan) {
+                    result = {std::min(result.low, args[i].low), std::max(result.high, args[i].high), true};
+                } else {
+                    result = {select(result.low, args[i].low), select(result.high, args[i].high), false};
+                }
+            }
+            return result;
+        }
+
+        static auto min(size_t argc, const Interval *args) -> Interval {
+            return extreme(argc, args, std::numeric_limits<number_t>::max(),
+                           [](number_t a, number_t b) { return std::min(a, b); });
+        }
+
+        static auto max(size_t argc, const Interval *args) -> Interval {
+            return extreme(argc, args, std::numeric_limits<number_t>::min(),
+                           [](number_t a, number_t b) { return std::max(a, b); });
+        }
+    };
+
+    auto addBuiltins() -> void {
+        // Constants
+        addVariable("pi") = static_cast<number_t>(M_PI);
+        addVariable("e")  = static_cast<number_t>(M_E);
+
+        // Built-in functions
+        addFunction("abs", std::abs, Purity::Pure);
+        addFunction("ceil", std::ceil, Purity::Pure);
+        addFunction("floor", std::floor, Purity::Pure);
+        addFunction("round", std::round, Purity::Pure);
+        addFunction("ln", std::log, Purity::Pure);
+        addFunction("log", std::log10, Purity::Pure);
+        addFunction("cos", std::cos, Purity::Pure);
+        addFunction("sin", std::sin, Purity::Pure);
+        addFunction("acos", std::acos, Purity::Pure);
+        addFunction("asin", std::asin, Purity::Pure);
+        addFunction("cosh", std::cosh, Purity::Pure);
+        addFunction("sinh", std::sinh, Purity::Pure);
+        addFunction("tan", std::tan, Purity::Pure);
+        addFunction("tanh", std::tanh, Purity::Pure);
+        addFunction("sqrt", std::sqrt, Purity::Pure);
+        addFunction("atan2", PM_FUNCTION_2(std::atan2), Purity::Pure);
+        addFunction("pow", PM_FUNCTION_2(std::pow), Purity::Pure);
+        addFunction(
+            "min",
+            [](size_t argc, const argument_list_t &args) -> Result {
+                number_t result{std::numeric_limits<number_t>::max()};
+                size_t   i = 0;
+                while (i < argc) {
+                    result = std::min(args[i], result);
+                    i++;
+                }
+                return result;
+            },
+            Purity::Pure);
+        addFunction(
+            "max",
+            [](size_t argc, const argument_list_t &args) -> Result {
+                number_t result{std::numeric_limits<number_t>::min()};
+                size_t   i = 0;
+                while (i < argc) {
+                    result = std::max(args[i], result);
+                    i++;
+                }
+                return result;
+            },
+            Purity::Pure);
+
+        // Interval rules
+        static constexpr std::array<std::pair<const char *, interval_function_t>, 19> rules{{
+            {"abs", Bounds::abs},   {"ceil", Bounds::ceil},   {"floor", Bounds::floor}, {"round", Bounds::round},
+            {"ln", Bounds::ln},     {"log", Bounds::log},     {"cos", Bounds::cos},     {"sin", Bounds::sin},
+            {"acos", Bounds::acos}, {"asin", Bounds::asin},   {"cosh", Bounds::cosh},   {"sinh", Bounds::sinh},
+            {"tan", Bounds::tan},   {"tanh", Bounds::tanh},   {"sqrt", Bounds::sqrt},   {"atan2", Bounds::atan2},
+            {"pow", Bounds::pow},   {"min", Bounds::min},     {"max", Bounds::max},
+        }};
+        for (const auto &rule : rules) {
+            setIntervalRule(rule.first, rule.second);
+        }
+    }
+
+  public:
+    /**
+     * @brief Creates a context with the built-in constants and functions.
+     * Built-ins live in a layer shared by every context, so construction doesn't allocate and the
+     * memory of a context only grows with its own additions.
+     */
+    PicoMath() : parent(builtins()) {
+    }
+
+    /**
+     * @brief Copies the variables, units, functions and arrays added to the context. Function caches
+     * of the copy start empty. Definitions inherited through fork() stay shared, as in the forked context.
+     */
+    PicoMath(const PicoMath &other)
+        : overlay(other.overlay == nullptr ? nullptr : std::make_shared<Layer>(*other.overlay)),
+          parent(other.parent), summation(other.summation) {
+    }
+
+    auto operator=(const PicoMath &other) -> PicoMath & {
+        if (this != &other) {
+            PicoMath copy(other);
+            *this = std::move(copy);
+        }
+        return *this;
+    }
+
+    PicoMath(PicoMath &&) = default;
+    auto operator=(PicoMath &&) -> PicoMath & = default;
+    ~PicoMath()                               = default;
+
+    /**
+     * @brief Creates a context that inherits every variable, unit and function of this one.
+     * Forking changes this context too: its additions are frozen into a layer shared by both
+     * contexts, so forking is cheap and configured tables are not copied. Later additions to either
+     * context are private. Variables and units of the shared layer are shared as well: changing
+     * their values through previously returned references affects both contexts. Calling addVariable
+     * or addUnit again for an inherited name creates a private copy, that hides the shared one.
+     * Function caches are never shared: this context keeps its caches in private copies of the
+     * functions, and the forked context starts with empty caches of the same capacity. Programs
+     * compiled before the fork call the shared functions, without a cache.
+     *
+     * @return PicoMath Forked context
+     */
+    auto fork() -> PicoMath {
+        std::vector<const Entry<Function> *> cached;
+        if (overlay != nullptr) {
+            std::shared_ptr<Layer> frozen = std::move(overlay);
+            frozen->parent                = std::move(parent);
+            parent                        = frozen;
+            // Caches are updated by every lookup, so they move out of the shared layer
+            for (auto &entry : frozen->functions) {
+                if (entry.second.cache != nullptr) {
+                    ownFunction(entry).cache = std::move(entry.second.cache);
+                    cached.push_back(&*overlay->functions.find(entry.first));
+                }
+            }
+        }
+        PicoMath child{Bare{}};
+        child.parent    = parent;
+        child.summation = summation;
+        for (const Entry<Function> *entry : cached) {
+            child.ownLayer().functions.emplace(*entry);
+        }
+        return child;
+    }
+
+    /**
+     * @brief Adds a variable to the parsing context.
+     * PicoMath returns a reference to entry inside the map of variables, that can be changed
+     * during multiple evaluations
+     *
+     * @param name Name of the variable
+     * @return number_t& Reference to variable's value
+     */
+    auto addVariable(const std::string &name) -> number_t & {
+        return addValue(&Layer::variables, name);
+    }
+
+    /**
+     * @brief Adds a scale unit to the parsing context
+     * PicoMath returns a reference to entry inside the map of variables, that can be changed
+     * during multiple evaluations.
+     *
+     * @param name Name of the unit
+     * @return number_t& Reference to the unit's scale value
+     */
+    auto addUnit(const std::string &name) -> number_t & {
+        return addValue(&Layer::units, name);
+    }
+
+    /**
+     * @brief Checks whether a variable or constant is defined, in this context or an inherited one
+     */
+    [[nodiscard]] auto hasVariable(std::string_view name) const -> bool {
+        return findVariable(name) != nullptr;
+    }
+
+    /**
+     * @brief Checks whether a unit is defined, in this context or an inherited one
+     */
+    [[nodiscard]] auto hasUnit(std::string_view name) const -> bool {
+        return findUnit(name) != nullptr;
+    }
+
+    /**
+     * @brief Adds an array variable to the parsing context.
+     * Arrays are bound to buffers owned by the caller and can only be used inside the reductions
+     * `sum`, `mean`, `min`, `max`, `dot` and `stddev`. Their argument is evaluated element by element,
+     * so `sum(a * b + x)` doesn't allocate temporary arrays. All the arrays of a reduction must have
+     * the same size, and scalar variables are used as is for every element.
+     *
+     * @param name Name of the array
+     * @return ArrayView& Reference to the binding, that can point to another buffer between evaluations
+     */
+    auto addArray(const std::string &name) -> ArrayView & {
+        return addValue(&Layer::arrays, name);
+    }
+
+    /**
+     * @brief Selects how reductions add up elements. Compiled expressions keep the mode they were
+     * compiled with
+     *
+     * @param mode Summation used by `sum`, `mean` and `dot`
+     */
+    auto setSummation(Summation mode) -> void {
+        summation = mode;
+    }
+
+    /**
+     * @brief Adds a custom function to the parsing context
+     * This overload allows the user to pass a function that can handle multiple arguments.
+     *
+     * @param name Name of the function
+     * @param func Function pointer
+     * @param purity Pure functions must return the same value for the same arguments
+     */
+    auto addFunction(const std::string &name, custom_function_many_t func, Purity purity = Purity::Impure) -> void {
+        addFunction(name, Function::Type::FunctionMany, purity).many = func;
+    }
+
+    /**
+     * @brief Adds a custom function to the parsing context
+     *
+     * @param name Name of the function
+     * @param func Function pointer
+     * @param purity Pure functions must return the same value for the same arguments
+     */
+    auto addFunction(const std::string &name, custom_function_1_t func, Purity purity = Purity::Impure) -> void {
+        addFunction(name, Function::Type::Function1, purity).f1 = func;
+    }
+
+    /**
+     * @brief Adds a custom function to the parsing context
+     * This overload receives one column per argument and evaluates many rows at once. It is called
+     * with blocks of rows by CompiledExpression::evalBatch, and with a single row otherwise.
+     *
+     * @param name Name of the function
+     * @param func Function pointer
+     * @param purity Pure functions must return the same value for the same arguments
+     */
+    auto addFunction(const std::string &name, custom_function_bulk_t func, Purity purity = Purity::Impure) -> void {
+        addFunction(name, Function::Type::FunctionBulk, purity).bulk = func;
+    }
+
+    /**
+     * @brief Enables a bounded cache of results for a pure function.
+     * Calls with the same arguments are served from the cache, in direct and compiled evaluations.
+     * Functions added with the bulk overload only use the cache when evaluating a single row.
+     * An inherited function is copied into this context first, so caches are never shared between
+     * contexts; programs compiled before keep calling the inherited function.
+     * Lookups update the cache without synchronization: a context with caches, and the programs
+     * compiled from it, must not be evaluated from several threads at once.
+     *
+     * @param name Name of the function
+     * @param capacity Number of cached results, rounded up to a power of two. Zero disables the cache
+     * @return true The cache was configured
+     * @return false The function doesn't exist or it isn't pure
+     */
+    auto setFunctionCache(std::string_view name, size_t capacity) -> bool {
+        const Entry<Function> *f = findFunction(name);
+        if (f == nullptr || f->second.purity != Purity::Pure) {
+            return false;
+        }
+        ownFunction(*f).cache = capacity == 0 ? nullptr : std::make_unique<FunctionCache>(capacity);
+        return true;
+    }
+
+    /**
+     * @brief Sets the rule that bounds the results of a function, used by CompiledExpression::bound
+     * and CompiledExpression::assume. The rule receives the intervals of the arguments and must return
+     * an interval containing every result of the function for arguments inside them. Functions
+     * without a rule can return any value. Every built-in function has a rule.
+     * Like caches, rules of inherited functions are set on a private copy of the function.
+     *
+     * @param name Name of the function
+     * @param rule Interval rule, or null to remove it
+     * @return true The rule was set
+     * @return false The function doesn't exist
+     */
+    auto setIntervalRule(std::string_view name, interval_function_t rule) -> bool {
+        const Entry<Function> *f = findFunction(name);
+        if (f == nullptr) {
+            return false;
+        }
+        ownFunction(*f).interval = rule;
+        return true;
+    }
+
+    /**
+     * @brief Returns the counters of the result cache of a function
+     *
+     * @param name Name of the function
+     * @return FunctionCacheStats Counters, all zero if the function has no cache
+     */
+    [[nodiscard]] auto getFunctionCacheStats(std::string_view name) const -> FunctionCacheStats {
+        const Entry<Function> *f = findFunction(name);
+        if (f == nullptr || f->second.cache == nullptr) {
+            return {};
+        }
+        return f->second.cache->getStats();
+    }
+
+    /**
+     * @brief Evaluates the expression and returns a value or an error if the expression is invalid
+     *
+     * @param expression Expression to evaluate
+     * @return Result Result containing the result value or an error
+     */
+    auto evalExpression(const char *expression) -> Result;
+
+    /**
+     * @brief Evaluates the expression within the limits of a budget.
+     * The evaluation is aborted as soon as a limit is exceeded, and the result is an error whose kind
+     * is ErrorKind::BudgetExceeded. CompiledExpression::getCost estimates the cost beforehand.
+     *
+     * @param expression Expression to evaluate
+     * @param budget Limits of the evaluation
+     * @return Result Result containing the result value or an error
+     */
+    auto evalExpression(const char *expression, const Budget &budget) -> Result;
+
+    /**
+     * @brief Creates a Expression that can be used to evaluate multiple expression separated by commas.
+     *
+     * @param expression MultiExpression to evaluate
+     * @return Expression Expression object maintaining the context of the multi-evaluation
+     */
+    auto evalMultiExpression(const char *expression) -> Expression;
+
+    /**
+     * @brief Evaluates a list of expressions separated by commas into a caller provided buffer,
+     * in a single pass. Invalid items are flagged in the error bitmap, their value is zero and the
+     * evaluation continues with the next item.
+     *
+     * @param expression List of expressions to evaluate
+     * @param out Output values, with room for `capacity` values
+     * @param capacity Maximum number of items to evaluate
+     * @param errors Bitmap with one bit per item, with room for `(capacity + 63) / 64` words
+     * @return size_t Number of items written
+     */
+    auto evalList(const char *expression, number_t *out, size_t capacity, uint64_t *errors) -> size_t;
+
+    /**
+     * @brief Compiles the expression into a program that can be evaluated many times.
+     * Variables, units and functions are bound by reference, so the context must outlive the
+     * compiled expression. Identical subexpressions and repeated calls to pure functions with the
+     * same arguments are computed once.
+     *
+     * @param expression Expression to compile
+     * @return CompiledExpression Compiled program or an error if the expression is invalid
+     */
+    auto compileExpression(const char *expression) -> CompiledExpression;
+
+    /**
+     * @brief Compiles a list of expressions separated by commas into a single program, evaluated
+     * with CompiledExpression::evalList. Subexpressions shared by several items are computed once.
+     * Items that fail to compile are reported as errors on every evaluation.
+     *
+     * @param expression List of expressions to compile
+     * @return CompiledExpression Compiled program with one output per item
+     */
+    auto compileList(const char *expression) -> CompiledExpression;
+};
+
+/**
+ * @brief Character level helpers shared by the evaluator and the compiler
+ */
+class Scanner {
+  protected:
+    const char *originalStr{};
+    const char *str{};
+
+    explicit Scanner(const char *expression) : originalStr(expression), str(expression) {
+    }
+
+    /**
+     * @brief Position reported by errors: the last consumed character
+     */
+    [[nodiscard]] auto errorPosition() const -> int {
+        return static_cast<int>(str - originalStr - 1);
+    }
+
+    [[nodiscard]] auto describeError(const char *error, std::string_view identifier = {}) const -> std::string {
+        std::string out = "In character " + std::to_string(errorPosition()) + ": ";
+        out += error;
+        if (identifier.empty()) {
+            out += " found: ";
+            out += isEOF() ? "End of string" : str;
+        } else {
+            out += ' ';
+            out += '`';
+            out += identifier;
+            out += '`';
+        }
+        return out;
+    }
+
+    PM_INLINE auto consume() -> char {
+        return *str++;
+    }
+
+    [[nodiscard]] PM_INLINE auto peek() const -> char {
+        return *str;
+    }
+
+    enum class CharClass
+    {
+        Space,
+        Alpha,
+        Unit,
+        Digit
+    };
+
+    template <CharClass charClass>
+    PM_INLINE static auto belongs(char c) -> bool {
+        bool alpha = (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_';
+        switch (charClass) {
+            case CharClass::Space:
+                return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+            case CharClass::Alpha:
+                return alpha;
+            case CharClass::Unit:
+                return alpha || c == '%';
+            default:
+                return c >= '0' && c <= '9';
+        }
+    }
+
+#if defined(PM_SIMD_WIDTH)
+    /**
+     * @brief Returns one bit per character of the aligned block that doesn't belong to the class
+     */
+    template <CharClass charClass>
+    PM_INLINE static auto classify(const char *block) -> uint32_t {
+#if PM_SIMD_WIDTH == 32
+        __m256i chunk   = _mm256_load_si256(reinterpret_cast<const __m256i *>(block));
+        auto    equal   = [&chunk](char c) { return _mm256_cmpeq_epi8(chunk, _mm256_set1_epi8(c)); };
+        auto    inRange = [](__m256i c, char low, char high) {
+            return _mm256_and_si256(_mm256_cmpgt_epi8(c, _mm256_set1_epi8(static_cast<char>(low - 1))),
+                                    _mm256_cmpgt_epi8(_mm256_set1_epi8(static_cast<char>(high + 1)), c));
+        };
+        auto    any     = [](__m256i a, __m256i b) { return _mm256_or_si256(a, b); };
+        auto    lower   = _mm256_or_si256(chunk, _mm256_set1_epi8(0x20));
+        auto    mask    = [](__m256i m) { return ~static_cast<uint32_t>(_mm256_movemask_epi8(m)); };
+#else
+        __m128i chunk   = _mm_load_si128(reinterpret_cast<const __m128i *>(block));
+        auto    equal   = [&chunk](char c) { return _mm_cmpeq_epi8(chunk, _mm_set1_epi8(c)); };
+        auto    inRange = [](__m128i c, char low, char high) {
+            return _mm_and_si128(_mm_cmpgt_epi8(c, _mm_set1_epi8(static_cast<char>(low - 1))),
+                                 _mm_cmpgt_epi8(_mm_set1_epi8(static_cast<char>(high + 1)), c));
+        };
+        auto    any     = [](__m128i a, __m128i b) { return _mm_or_si128(a, b); };
+        auto    lower   = _mm_or_si128(chunk, _mm_set1_epi8(0x20));
+        auto    mask    = [](__m128i m) { return ~static_cast<uint32_t>(_mm_movemask_epi8(m)) & 0xFFFFU; };
+#endif
+        // Signed comparisons are fine, every character of the grammar is ASCII
+        switch (charClass) {
+            case CharClass::Space:
+                return mask(any(any(equal(' '), equal('\t')), any(equal('\r'), equal('\n'))));
+            case CharClass::Alpha:
+                return mask(any(inRange(lower, 'a', 'z'), equal('_')));
+            case CharClass::Unit:
+                return mask(any(inRange(lower, 'a', 'z'), any(equal('_'), equal('%'))));
+            default:
+                return mask(inRange(chunk, '0', '9'));
+        }
+    }
+
+    /**
+     * @brief Returns the first character at or after `p` that doesn't belong to the class.
+     * Runs longer than one block are scanned a block at a time. Blocks are loaded from aligned
+     * addresses, so reading past the end of the string never crosses into another page. The
+     * terminator doesn't belong to any class and stops the scan.
+     */
+    template <CharClass charClass>
+    PM_INLINE static auto skip(const char *p) -> const char * {
+        // Short runs are common: single letter variables, small numbers, single spaces. Setting up
+        // a vector costs more than checking them one at a time
+        for (int i = 0; i < PM_SIMD_WIDTH; i++, p++) {
+            if (!belongs<charClass>(*p)) {
+                return p;
+            }
+        }
+        return skipRun<charClass>(p);
+    }
+
+    template <CharClass charClass>
+    static auto skipRun(const char *p) -> const char * {
+        auto        offset = reinterpret_cast<uintptr_t>(p) % PM_SIMD_WIDTH; // NOLINT
+        const char *block  = p - offset;
+        uint32_t    stops  = classify<charClass>(block) >> offset;
+        if (PM_LIKELY(stops != 0)) {
+            return p + __builtin_ctz(stops);
+        }
+        while (true) {
+            block += PM_SIMD_WIDTH;
+            stops = classify<charClass>(block);
+            if (stops != 0) {
+                return block + __builtin_ctz(stops);
+            }
+        }
+    }
+#else
+    template <CharClass charClass>
+    PM_INLINE static auto skip(const char *p) -> const char * {
+        while (belongs<charClass>(*p)) {
+            p++;
+        }
+        return p;
+    }
+#endif
+
+    PM_INLINE void consumeSpace() {
+        // Most tokens are followed by no space or by a single one
+        if (PM_LIKELY(!belongs<CharClass::Space>(*str))) {
+            return;
+        }
+        str = skip<CharClass::Space>(str + 1);
+    }
+
+    [[nodiscard]] PM_INLINE auto isDigit() const -> bool {
+        return *str >= '0' && *str <= '9';
+    }
+
+    [[nodiscard]] PM_INLINE auto isAlpha() const -> bool {
+        return (*str >= 'a' && *str <= 'z') || (*str >= 'A' && *str <= 'Z') || (*str == '_');
+    }
+
+    [[nodiscard]] PM_INLINE auto isUnitChar() const -> bool {
+        return isAlpha() || *str == '%';
+    }
+
+    [[nodiscard]] PM_INLINE auto isEOF() const -> bool {
+        return *str == 0;
+    }
+
+    [[nodiscard]] PM_INLINE auto isSign() const -> bool {
+        return *str == '+' || *str == '-';
+    }
+
+    [[nodiscard]] PM_INLINE auto isExponent() const -> bool {
+        // This doesn't read out of bounds because:
+        // if first character is 'e' or 'E', next character can be a valid character
+        // or zero if it's the end of the string
+        return (*str == 'e' || *str == 'E') &&
+               (*(str + 1) == '+' || *(str + 1) == '-' || (*(str + 1) >= '0' && *(str + 1) <= '9'));
+    }
+
+    /**
+     * @brief Moves to the comma that ends the item beginning at `start`, skipping parenthesized commas
+     */
+    auto skipItem(const char *start) -> void {
+        str       = start;
+        int depth = 0;
+        while (!isEOF() && (depth > 0 || peek() != ',')) {
+            char c = consume();
+            if (c == '(') {
+                depth++;
+            } else if (c == ')') {
+                depth--;
+            }
+        }
+    }
+
+    PM_INLINE auto scanIdentifier() -> std::string_view {
+        const char *start = str;
+        str               = skip<CharClass::Alpha>(str + 1);
+        return {start, static_cast<size_t>(str - start)};
+    }
+
+    PM_INLINE auto scanUnit() -> std::string_view {
+        const char *start = str;
+        str               = skip<CharClass::Unit>(str + 1);
+        return {start, static_cast<size_t>(str - start)};
+    }
+
+    /**
+     * @brief Scans a number literal, without units
+     *
+     * @param value Parsed value
+     * @param literal Text of the literal when it is out of range
+     * @return false The literal is out of range
+     */
+    PM_INLINE auto scanNumber(number_t &value, [[maybe_unused]] std::string_view &literal) noexcept -> bool {
+        number_t ret = 0;
+
+#if defined(PM_USE_PRECISE_FLOAT_PARSING)
+        char *end;
+        ret = PM_STR_TO_FLOAT(str, &end);
+        if (PM_UNLIKELY(errno == ERANGE)) {
+            literal = {str, static_cast<size_t>(end - str)};
+            return false;
+        }
+        str = end;
+#else
+        // The end of digit runs is found first, so the loops don't test every character
+        const char *end = skip<CharClass::Digit>(str);
+        for (; str != end; str++) {
+            ret = ret * 10 + (*str - '0');
+        }
+        // Decimal point
+        if (peek() == '.') {
+            consume();
+            end             = skip<CharClass::Digit>(str);
+            number_t weight = 1;
+            for (; str != end; str++) {
+                weight /= 10;
+                ret += (*str - '0') * weight;
+            }
+        }
+        if (PM_UNLIKELY(isExponent())) {
+            consume();
+            bool sign = false;
+            if (isSign()) {
+                if (consume() == '-') {
+                    sign = true;
+                }
+            }
+            int exp = 0;
+            while (PM_LIKELY(isDigit())) {
+                exp = exp * 10 + (*str - '0');
+                consume();
+            }
+            ret *= std::pow(static_cast<number_t>(10), sign ? -exp : exp);
+        }
+#endif
+        value = ret;
+        return true;
+    }
+};
+
+/**
+ * @brief Evaluates an expression while parsing it. The budgeted variant counts operations and
+ * nesting for evalExpression with a Budget; the other one has no accounting on its hot path.
+ */
+template <bool budgeted>
+class BasicExpression : Scanner {
+    friend PicoMath;
+
+    const PicoMath &context;
+    Budget          budget{};
+    bool            hasDeadline{false};
+    size_t          operations{0};
+    size_t          depth{0};
+    // Operations after which the budget is checked again
+    size_t checkpoint{std::numeric_limits<size_t>::max()};
+
+    BasicExpression(const PicoMath &picomathContext, const char *expression)
+        : Scanner(expression), context(picomathContext) {
+    }
+
+    BasicExpression(const PicoMath &picomathContext, const char *expression, const Budget &limits)
+        : Scanner(expression), context(picomathContext), budget(limits),
+          hasDeadline(limits.deadline != std::chrono::steady_clock::time_point::max()),
+          checkpoint(hasDeadline ? std::min<size_t>(limits.maxOperations, PM_DEADLINE_INTERVAL)
+                                 : limits.maxOperations) {
+    }
+
+    auto evalSingle() -> Result {
+        Result ret = evalExpression();
+        consumeSpace();
+        if (PM_LIKELY(isEOF() || ret.isError())) {
+            return ret;
+        }
+        return generateError("Invalid characters after expression");
+    }
+
+  public:
+    /**
+     * @brief Evaluates the next expression in the multi expression context
+     *
+     * @param outResult Result of the evaluation
+     * @return true The evaluation succeeded and the outResult parameter contains a valid output value.
+     * @return false There are no more expressions to evaluate
+     */
+    auto evalNext(Result *outResult) -> bool {
+        consumeSpace();
+        if (isEOF()) {
+            return false;
+        }
+        *outResult = evalExpression();
+        consumeSpace();
+        if (peek() == ',') {
+            consume();
+            consumeSpace();
+        }
+        return true;
+    }
+
+  private:
+    auto evalList(number_t *out, size_t capacity, uint64_t *errors) -> size_t {
+        size_t count = 0;
+        consumeSpace();
+        while (count < capacity && !isEOF()) {
+            const char *start = str;
+            Result      item  = evalExpression();
+            consumeSpace();
+            bool error = item.isError() || (peek() != ',' && !isEOF());
+            if (PM_UNLIKELY(error)) {
+                skipItem(start);
+            }
+            out[count] = error ? 0 : item.result;
+            if (error) {
+                errors[count / 64] |= uint64_t{1} << (count % 64);
+            } else {
+                errors[count / 64] &= ~(uint64_t{1} << (count % 64));
+            }
+            count++;
+            if (peek() == ',') {
+                consume();
+                consumeSpace();
+            }
+        }
+        return count;
+    }
+
+    auto generateError(const char *error, std::string_view identifier = {}) const -> Result {
+        return describeError(error, identifier);
+    }
+
+    [[nodiscard]] auto locateError(const char *error) const -> std::string {
+        // The rest of the expression is not copied into the message, it can be huge
+        return "In character " + std::to_string(errorPosition()) + ": " + error;
+    }
+
+    auto generateBudgetError(const char *error) const -> Result {
+        return {locateError(error), ErrorKind::BudgetExceeded};
+    }
+
+    [[nodiscard]] auto isPastDeadline() const -> bool {
+        return budgeted && hasDeadline && std::chrono::steady_clock::now() >= budget.deadline;
+    }
+
+    /**
+     * @brief Checks the budget when the operation count reaches the checkpoint or the depth reaches the limit
+     *
+     * @return const char* Description of the exceeded limit, or nullptr if the evaluation can continue
+     */
+    auto checkBudget() -> const char * {
+        if (depth >= budget.maxDepth) {
+            return "Nesting too deep";
+        }
+        if (operations > budget.maxOperations) {
+            return "Operation budget exceeded";
+        }
+        if (isPastDeadline()) {
+            return "Deadline exceeded";
+        }
+        checkpoint = std::min<size_t>(budget.maxOperations, operations + PM_DEADLINE_INTERVAL);
+        return nullptr;
+    }
+
+    PM_INLINE auto evalExpression() -> Result {
+        consumeSpace();
+        if (PM_UNLIKELY(isEOF())) {
+            return generateError("Unexpected end of the string");
+        }
+        return parseAddition();
+    }
+
+    auto parseReduction(std::string_view identifier, Result &outResult) -> bool;
+
+    PM_INLINE auto parseFunction(std::string_view identifier) noexcept -> Result {
+        if (PM_UNLIKELY(context.hasArrays())) {
+            Result reduction;
+            if (parseReduction(identifier, reduction)) {
+                return reduction;
+            }
+        }
+        auto f = context.findFunction(identifier);
+        if (PM_UNLIKELY(f == nullptr)) {
+            return generateError("Unknown function", identifier);
+        }
+
+        // Consume '('
+        consume();
+        consumeSpace();
+
+        std::array<number_t, PM_MAX_ARGUMENTS> arguments{};
+        size_t                                 argc = 0;
+
+        if (peek() != ')') {
+            while (true) {
+                if (PM_UNLIKELY(argc == PM_MAX_ARGUMENTS)) {
+                    return generateError("Too many arguments");
+                }
+                Result argument = evalExpression();
+                if (PM_UNLIKELY(argument.isError())) {
+                    return argument;
+                }
+                arguments[argc] = argument.result;
+                argc++;
+                consumeSpace();
+                if (peek() != ',') {
+                    break;
+                }
+                consume();
+            }
+        }
+
+        if (PM_UNLIKELY(peek() != ')')) {
+            return generateError("Expected ')'");
+        }
+        consume();
+
+        if (f->second.type == PicoMath::Function::Type::Function1) {
+            if (PM_UNLIKELY(argc != 1)) {
+                return generateError("One argument required");
+            }
+        }
+        Result ret = f->second.call(argc, arguments);
+        if (PM_UNLIKELY(ret.isError())) {
+            // Improve information in errors generated inside functions
+            return generateError(ret.getError(), identifier);
+        }
+        // Custom functions can be slow, check the deadline after each call
+        if (PM_UNLIKELY(isPastDeadline())) {
+            return generateBudgetError("Deadline exceeded");
+        }
+        return ret;
+    }
+
+    PM_INLINE auto parseParenthesized() -> Result {
+        consume();
+        consumeSpace();
+        Result exp = evalExpression();
+        if (PM_UNLIKELY(exp.isError())) {
+            return exp;
+        }
+        consumeSpace();
+        // consume ')'
+        if (PM_UNLIKELY(peek() != ')')) {
+            return generateError("Expected ')'");
+        }
+        consume();
+        return exp;
+    }
+
+    auto parsePrefixUnaryOperator() -> Result {
+        char op = consume();
+        consumeSpace();
+        Result unary = parseSubExpression();
+        if (PM_UNLIKELY(unary.isError())) {
+            return unary;
+        }
+        if (op == '-') {
+            unary.result = -unary.result;
+        }
+        return unary;
+    }
+
+    PM_INLINE auto parseVariableOrFunction() noexcept -> Result {
+        std::string_view identifier = scanIdentifier();
+        consumeSpace();
+        if (peek() == '(') {
+            // function call
+            return parseFunction(identifier);
+        }
+        auto f = context.findVariable(identifier);
+        if (PM_UNLIKELY(f == nullptr)) {
+            if (context.findArray(identifier) != nullptr) {
+                return generateError("Array used outside of a reduction", identifier);
+            }
+            return generateError("Unknown variable", identifier);
+        }
+        return {f->second};
+    }
+
+    PM_INLINE auto parseNumber() noexcept -> Result {
+        number_t         ret = 0;
+        std::string_view literal;
+        if (PM_UNLIKELY(!scanNumber(ret, literal))) {
+            return generateError("Float out of range", literal);
+        }
+
+        // Space before units
+        consumeSpace();
+
+        // Units and percentage
+        if (isUnitChar()) {
+            std::string_view identifier = scanUnit();
+
+            auto f = context.findUnit(identifier);
+            if (PM_UNLIKELY(f == nullptr)) {
+                return generateError("Unknown unit", identifier);
+            }
+            ret = ret * f->second;
+        }
+        return ret;
+    }
+
+    PM_INLINE auto parseSubExpression() -> Result {
+        if constexpr (!budgeted) {
+            return parseOperand();
+        } else {
+            operations++;
+            if (PM_UNLIKELY(operations > checkpoint || depth >= budget.maxDepth)) {
+                const char *exceeded = checkBudget();
+                if (exceeded != nullptr) {
+                    return generateBudgetError(exceeded);
+                }
+            }
+            depth++;
+            Result ret = parseOperand();
+            depth--;
+            return ret;
+        }
+    }
+
+    PM_INLINE auto parseOperand() -> Result {
+        if (isDigit() || peek() == '.') {
+            // Number
+            return parseNumber();
+        }
+        if (peek() == '(') {
+            // Parenthesized expression
+            return parseParenthesized();
+        }
+        if (peek() == '-' || peek() == '+') {
+            // Prefix unary operator
+            return parsePrefixUnaryOperator();
+        }
+        if (isAlpha()) {
+            // Variable or function
+            return parseVariableOrFunction();
+        }
+        return generateError("Invalid character");
+    }
+
+    auto parseAddition() -> Result {
+        consumeSpace();
+        Result left = parseMultiplication();
+        if (PM_UNLIKELY(left.isError())) {
+            return left;
+        }
+        consumeSpace();
+        while (*str == '+' || *str == '-') {
+            char op = consume();
+            consumeSpace();
+            Result right = parseMultiplication();
+            if (PM_UNLIKELY(right.isError())) {
+                return right;
+            }
+            if (op == '+') {
+                left.result += right.result;
+            } else {
+                left.result -= right.result;
+            }
+            consumeSpace();
+        }
+        return left;
+    }
+
+    auto parseMultiplication() -> Result {
+        consumeSpace();
+        Result left = parseSubExpression();
+        if (PM_UNLIKELY(left.isError())) {
+            return left;
+        }
+        consumeSpace();
+        while (*str == '*' || *str == '/') {
+            char op = consume();
+            consumeSpace();
+            Result right = parseSubExpression();
+            if (PM_UNLIKELY(right.isError())) {
+                return right;
+            }
+            if (op == '*') {
+                left.result *= right.result;
+            } else if (op == '/') {
+                left.result /= right.result;
+            }
+            consumeSpace();
+        }
+        return left;
+    }
+};
+
+/**
+ * @brief Static cost of an expression, measured in the units of Budget
+ */
+struct ExpressionCost {
+    size_t operations{0}; // Operations of a direct evaluation, see Budget::maxOperations
+    size_t depth{0};      // Deepest nesting, see Budget::maxDepth
+    size_t calls{0};      // Calls to custom functions, whose own cost is unknown
+};
+
+/**
+ * @brief Expression compiled into a flat program of nodes.
+ * Every node writes one slot and only reads slots of previous nodes, so the program is evaluated
+ * with a single forward pass. Nodes are interned while compiling: identical subexpressions and
+ * calls to pure functions with identical arguments share one node, and operations whose operands
+ * are constants are folded.
+ */
+class CompiledExpression {
+    friend PicoMath;
+    template <bool>
+    friend class BasicExpression;
+    friend Compiler;
+    friend RuleSet;
+
+    enum class Op : uint8_t
+    {
+        Constant    = 0,
+        Load        = 1,
+        Negate      = 2,
+        Add         = 3,
+        Subtract    = 4,
+        Multiply    = 5,
+        Divide      = 6,
+        Call        = 7,
+        MultiplyAdd = 8,
+        Call1       = 9,
+        Element     = 10,
+        Reduce      = 11
+    };
+
+    enum class Reduction : uint8_t
+    {
+        Sum    = 0,
+        Mean   = 1,
+        Min    = 2,
+        Max    = 3,
+        Dot    = 4,
+        StdDev = 5
+    };
+
+    struct Node {
+        Op                        op{Op::Constant};
+        uint32_t                  a{0};        // First operand, first entry in `operands` for calls, or
+                                               // entry in `arrays` and `reductions`
+        uint32_t                  b{0};        // Second operand, or number of arguments for calls
+        uint32_t                  c{0};        // Addend of MultiplyAdd
+        const number_t *          source{};    // Variable or unit read by Load
+        const PicoMath::Function *function{};  // Function invoked by Call
+        const std::string *       name{};      // Name of the function, for error messages
+        uint32_t                  position{0}; // Character of the call in the source, for error messages
+    };
+
+    /**
+     * @brief Reduction of an element-wise program, evaluated by a Reduce node
+     */
+    struct ReductionNode {
+        Reduction                           kind{Reduction::Sum};
+        Summation                           summation{Summation::Fast};
+        std::string                         name{};
+        std::unique_ptr<CompiledExpression> program{};
+        uint32_t                            position{0}; // Character of the call in the source, for error messages
+    };
+
+    using Key = std::tuple<Op, uint64_t, uint32_t, uint32_t, std::vector<uint32_t>>;
+
+    std::vector<Node>        nodes{};
+    std::vector<uint32_t>    operands{};
+    std::vector<uint32_t>    outputs{};
+    std::vector<number_t>    slots{};
+    std::map<Key, uint32_t>  interned{};
+    std::unique_ptr<error_t> error{};
+    size_t                   requested{0}; // Nodes requested by the source, before deduplication
+    ExpressionCost           cost{};
+
+    std::vector<const ArrayView *> arrays{};     // Arrays read by Element nodes
+    std::vector<ReductionNode>     reductions{}; // Programs evaluated by Reduce nodes
+    // Checked between the blocks of a reduction, set by direct evaluation with a Budget
+    std::chrono::steady_clock::time_point deadline{std::chrono::steady_clock::time_point::max()};
+
+    // Scratch of evalBatch: one column of PM_BATCH_SIZE rows per node
+    std::vector<number_t>         batchSlots{};
+    std::vector<const number_t *> batchColumns{};
+    std::vector<const number_t *> batchInputs{};
+
+    // Failing nodes of the last evalList
+    std::vector<uint8_t> failed{};
+
+    static constexpr uint32_t invalidNode = std::numeric_limits<uint32_t>::max();
+
+    /**
+     * @brief Running state of a reduction, fed with one block of values at a time.
+     * Kernels keep independent partial results in lanes, so their loops are vectorized.
+     */
+    class Accumulator {
+        static constexpr size_t lanes = 8;
+        using Lanes                   = std::array<number_t, lanes>;
+
+        Reduction kind;
+        Summation summation;
+        size_t    count{0};
+        Lanes     partial{};      // Sums, minimums or maximums
+        Lanes     compensation{}; // Kahan: low order bits lost by each lane
+        // Pairwise: levels[k] holds the sum of 2^k blocks, while bit k of `occupied` is set
+        std::array<number_t, 64> levels{};
+        uint64_t                 occupied{0};
+        // StdDev: blocks are combined with the parallel algorithm of Chan et al.
+        number_t mean{0};
+        number_t squares{0};
+
+        static auto combine(const Lanes &values) -> number_t {
+            return ((values[0] + values[1]) + (values[2] + values[3])) +
+                   ((values[4] + values[5]) + (values[6] + values[7]));
+        }
+
+        static auto sumLanes(const number_t *values, size_t rows, Lanes &sums) -> void {
+            Lanes  acc = sums;
+            size_t row = 0;
+            for (; row + lanes <= rows; row += lanes) {
+                for (size_t lane = 0; lane < lanes; lane++) {
+                    acc[lane] += values[row + lane];
+                }
+            }
+            for (; row < rows; row++) {
+                acc[row % lanes] += values[row];
+            }
+            sums = acc;
+        }
+
+        static auto pairwise(const number_t *values, size_t rows) -> number_t {
+            if (rows <= 4 * lanes) {
+                Lanes sums{};
+                sumLanes(values, rows, sums);
+                return combine(sums);
+            }
+            size_t half = rows / 2;
+            return pairwise(values, half) + pairwise(values + half, rows - half);
+        }
+
+        auto addKahan(const number_t *values, size_t rows) -> void {
+            Lanes  sums  = partial;
+            Lanes  lost  = compensation;
+            size_t row   = 0;
+            auto   add   = [&sums, &lost](size_t lane, number_t value) {
+                number_t y = value - lost[lane];
+                number_t t = sums[lane] + y;
+                lost[lane] = (t - sums[lane]) - y;
+                sums[lane] = t;
+            };
+            for (; row + lanes <= rows; row += lanes) {
+                for (size_t lane = 0; lane < lanes; lane++) {
+                    add(lane, values[row + lane]);
+                }
+            }
+            for (; row < rows; row++) {
+                add(row % lanes, values[row]);
+            }
+            partial      = sums;
+            compensation = lost;
+        }
+
+        auto addPairwise(const number_t *values, size_t rows) -> void {
+            number_t carry = pairwise(values, rows);
+            size_t   level = 0;
+            while ((occupied & (uint64_t{1} << level)) != 0) {
+                carry += levels[level];
+                occupied &= ~(uint64_t{1} << level);
+                level++;
+            }
+            levels[level] = carry;
+            occupied |= uint64_t{1} << level;
+        }
+
+        template <typename Select>
+        auto addExtreme(const number_t *values, size_t rows, Select select) -> void {
+            if (count == 0) {
+                partial.fill(values[0]);
+            }
+            Lanes  acc = partial;
+            size_t row = 0;
+            for (; row + lanes <= rows; row += lanes) {
+                for (size_t lane = 0; lane < lanes; lane++) {
+                    acc[lane] = select(values[row + lane], acc[lane]);
+                }
+            }
+            for (; row < rows; row++) {
+                acc[row % lanes] = select(values[row], acc[row % lanes]);
+            }
+            partial = acc;
+        }
+
+        auto addDeviations(const number_t *values, size_t rows) -> void {
+            Lanes sums{};
+            sumLanes(values, rows, sums);
+            number_t blockMean = combine(sums) / static_cast<number_t>(rows);
+            Lanes    squared{};
+            size_t   row = 0;
+            for (; row + lanes <= rows; row += lanes) {
+                for (size_t lane = 0; lane < lanes; lane++) {
+                    number_t deviation = values[row + lane] - blockMean;
+                    squared[lane] += deviation * deviation;
+                }
+            }
+            for (; row < rows; row++) {
+                number_t deviation = values[row] - blockMean;
+                squared[row % lanes] += deviation * deviation;
+            }
+            auto     n     = static_cast<number_t>(count);
+            auto     m     = static_cast<number_t>(rows);
+            number_t delta = blockMean - mean;
+            mean += delta * m / (n + m);
+            squares += combine(squared) + delta * delta * n * m / (n + m);
+        }
+
+        [[nodiscard]] auto total() const -> number_t {
+            switch (summation) {
+                case Summation::Pairwise: {
+                    number_t sum = 0;
+                    for (size_t level = 0; level < levels.size(); level++) {
+                        if ((occupied & (uint64_t{1} << level)) != 0) {
+                            sum += levels[level];
+                        }
+                    }
+                    return sum;
+                }
+                case Summation::Kahan: {
+                    // Lanes and their compensations are added with one more compensated sum
+                    number_t sum  = 0;
+                    number_t lost = 0;
+                    for (size_t lane = 0; lane < lanes; lane++) {
+                        for (number_t value : {partial[lane], -compensation[lane]}) {
+                            number_t y = value - lost;
+                            number_t t = sum + y;
+                            lost       = (t - sum) - y;
+                            sum        = t;
+                        }
+                    }
+                    return sum;
+                }
+                default:
+                    return combine(partial);
+            }
+        }
+
+      public:
+        Accumulator(Reduction reduction, Summation mode) : kind(reduction), summation(mode) {
+        }
+
+        auto add(const number_t *values, size_t rows) -> void {
+            switch (kind) {
+                case Reduction::Min:
+                    addExtreme(values, rows, [](number_t x, number_t m) { return x < m ? x : m; });
+                    break;
+                case Reduction::Max:
+                    addExtreme(values, rows, [](number_t x, number_t m) { return x > m ? x : m; });
+                    break;
+                case Reduction::StdDev:
+                    addDeviations(values, rows);
+                    break;
+                default:
+                    if (summation == Summation::Pairwise) {
+                        addPairwise(values, rows);
+                    } else if (summation == Summation::Kahan) {
+                        addKahan(values, rows);
+                    } else {
+                        sumLanes(values, rows, partial);
+                    }
+                    break;
+            }
+            count += rows;
+        }
+
+        [[nodiscard]] auto result() const -> Result {
+            switch (kind) {
+                case Reduction::Sum:
+                case Reduction::Dot:
+                    return total();
+                case Reduction::Mean:
+                    return total() / static_cast<number_t>(count);
+                case Reduction::Min:
+                    return *std::min_element(partial.begin(), partial.end());
+                case Reduction::Max:
+                    return *std::max_element(partial.begin(), partial.end());
+                default:
+                    return std::sqrt(squares / static_cast<number_t>(count));
+            }
+        }
+    };
+
+    static auto findReduction(std::string_view name, Reduction &kind) -> bool {
+        static constexpr std::array<std::string_view, 6> names{"sum", "mean", "min", "max", "dot", "stddev"};
+        for (size_t i = 0; i < names.size(); i++) {
+            if (names[i] == name) {
+                kind = static_cast<Reduction>(i);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    static auto bitsOf(number_t value) -> uint64_t {
+        uint64_t bits = 0;
+        std::memcpy(&bits, &value, sizeof(number_t));
+        return bits;
+    }
+
+    [[nodiscard]] auto isConstant(uint32_t node) const -> bool {
+        return nodes[node].op == Op::Constant;
+    }
+
+    auto intern(Key &&key, Node node, number_t value = 0) -> uint32_t {
+        auto found = interned.find(key);
+        if (found != interned.end()) {
+            return found->second;
+        }
+        auto index = static_cast<uint32_t>(nodes.size());
+        nodes.push_back(node);
+        slots.push_back(value);
+        interned.emplace(std::move(key), index);
+        return index;
+    }
+
+    auto internConstant(number_t value) -> uint32_t {
+        Node node;
+        node.op = Op::Constant;
+        return intern({Op::Constant, bitsOf(value), 0, 0, {}}, node, value);
+    }
+
+    auto emitConstant(number_t value) -> uint32_t {
+        requested++;
+        return internConstant(value);
+    }
+
+    auto emitLoad(const number_t *source) -> uint32_t {
+        requested++;
+        Node node;
+        node.op     = Op::Load;
+        node.source = source;
+        return intern({Op::Load, reinterpret_cast<uintptr_t>(source), 0, 0, {}}, node); // NOLINT
+    }
+
+    auto emitNegate(uint32_t a) -> uint32_t {
+        requested++;
+        if (isConstant(a)) {
+            return internConstant(-slots[a]);
+        }
+        Node node;
+        node.op = Op::Negate;
+        node.a  = a;
+        return intern({Op::Negate, 0, a, 0, {}}, node);
+    }
+
+    auto emitBinary(Op op, uint32_t a, uint32_t b) -> uint32_t {
+        requested++;
+        if (isConstant(a) && isConstant(b)) {
+            return internConstant(fold(op, slots[a], slots[b]));
+        }
+        // Addition and multiplication are commutative, so `x*y` and `y*x` share a node
+        if ((op == Op::Add || op == Op::Multiply) && b < a) {
+            std::swap(a, b);
+        }
+        Node node;
+        node.op = op;
+        node.a  = a;
+        node.b  = b;
+        return intern({op, 0, a, b, {}}, node);
+    }
+
+    auto emitCall(const PicoMath::Function &function, const std::string &name, const std::vector<uint32_t> &args,
+                  uint32_t position = 0) -> uint32_t {
+        requested++;
+        bool pure = function.purity == Purity::Pure;
+        if (pure) {
+            bool constantArguments = true;
+            for (uint32_t arg : args) {
+                constantArguments = constantArguments && isConstant(arg);
+            }
+            if (constantArguments) {
+                argument_list_t values{};
+                for (size_t i = 0; i < args.size(); i++) {
+                    values[i] = slots[args[i]];
+                }
+                Result folded = function.invoke(args.size(), values);
+                if (folded.isOk()) {
+                    return internConstant(folded.getResult());
+                }
+                // Errors are reported when the program is evaluated
+            }
+        }
+        Node node;
+        node.op       = Op::Call;
+        node.a        = static_cast<uint32_t>(operands.size());
+        node.b        = static_cast<uint32_t>(args.size());
+        node.function = &function;
+        node.name     = &name;
+        node.position = position;
+        if (!pure) {
+            // Impure functions are evaluated once per call site
+            operands.insert(operands.end(), args.begin(), args.end());
+            nodes.push_back(node);
+            slots.push_back(0);
+            return static_cast<uint32_t>(nodes.size() - 1);
+        }
+        auto     functionId = reinterpret_cast<uintptr_t>(&function); // NOLINT
+        size_t   count      = nodes.size();
+        uint32_t index      = intern({Op::Call, functionId, 0, 0, args}, node);
+        if (nodes.size() != count) {
+            operands.insert(operands.end(), args.begin(), args.end());
+        }
+        return index;
+    }
+
+    auto emitElement(const ArrayView *array) -> uint32_t {
+        requested++;
+        Node node;
+        node.op         = Op::Element;
+        node.a          = static_cast<uint32_t>(arrays.size());
+        size_t   count  = nodes.size();
+        uint32_t index  = intern({Op::Element, reinterpret_cast<uintptr_t>(array), 0, 0, {}}, node); // NOLINT
+        if (nodes.size() != count) {
+            arrays.push_back(array);
+        }
+        return index;
+    }
+
+    auto emitReduce(Reduction kind, Summation summation, std::string_view name,
+                    std::unique_ptr<CompiledExpression> program, uint32_t position = 0) -> uint32_t {
+        requested++;
+        Node node;
+        node.op = Op::Reduce;
+        node.a  = static_cast<uint32_t>(reductions.size());
+        reductions.push_back({kind, summation, std::string(name), std::move(program), position});
+        // Arrays can change between evaluations, so reductions are never shared
+        nodes.push_back(node);
+        slots.push_back(0);
+        return static_cast<uint32_t>(nodes.size() - 1);
+    }
+
+    /**
+     * @brief Drops the nodes emitted after the program had `nodeCount` nodes and `operandCount` operands
+     */
+    auto rollback(size_t nodeCount, size_t operandCount) -> void {
+        // Arrays and reductions of the dropped nodes were appended after the ones that are kept
+        size_t arrayCount     = arrays.size();
+        size_t reductionCount = reductions.size();
+        for (size_t i = nodeCount; i < nodes.size(); i++) {
+            if (nodes[i].op == Op::Element) {
+                arrayCount = std::min<size_t>(arrayCount, nodes[i].a);
+            } else if (nodes[i].op == Op::Reduce) {
+                reductionCount = std::min<size_t>(reductionCount, nodes[i].a);
+            }
+        }
+        arrays.resize(arrayCount);
+        reductions.resize(reductionCount);
+        nodes.resize(nodeCount);
+        slots.resize(nodeCount);
+        operands.resize(operandCount);
+        for (auto it = interned.begin(); it != interned.end();) {
+            it = it->second >= nodeCount ? interned.erase(it) : std::next(it);
+        }
+    }
+
+    /**
+     * @brief Copies the nodes used by `roots` into a new program, whose outputs are the copied roots.
+     * Reductions are moved, so the nodes of the roots must be dropped afterwards with rollback
+     */
+    auto extract(const std::vector<uint32_t> &roots) -> std::unique_ptr<CompiledExpression> {
+        auto                  target = std::make_unique<CompiledExpression>();
+        std::vector<uint32_t> remap(nodes.size(), invalidNode);
+        for (uint32_t root : roots) {
+            remap[root] = 0;
+        }
+        for (size_t i = nodes.size(); i-- > 0;) {
+            if (remap[i] != invalidNode) {
+                forEachOperand(nodes[i], [&remap](uint32_t &operand) { remap[operand] = 0; });
+            }
+        }
+        std::vector<uint32_t> args;
+        for (size_t i = 0; i < nodes.size(); i++) {
+            const Node &node = nodes[i];
+            if (remap[i] == invalidNode) {
+                continue;
+            }
+            switch (node.op) {
+                case Op::Constant:
+                    remap[i] = target->internConstant(slots[i]);
+                    break;
+                case Op::Load:
+                    remap[i] = target->emitLoad(node.source);
+                    break;
+                case Op::Element:
+                    remap[i] = target->emitElement(arrays[node.a]);
+                    break;
+                case Op::Reduce: {
+                    ReductionNode &reduction = reductions[node.a];
+                    remap[i] = target->emitReduce(reduction.kind, reduction.summation, reduction.name,
+                                                  std::move(reduction.program), reduction.position);
+                    break;
+                }
+                case Op::Negate:
+                    remap[i] = target->emitNegate(remap[node.a]);
+                    break;
+                case Op::MultiplyAdd:
+                    remap[i] = target->emitBinary(
+                        Op::Add, target->emitBinary(Op::Multiply, remap[node.a], remap[node.b]), remap[node.c]);
+                    break;
+                case Op::Call1:
+                case Op::Call: {
+                    size_t argc = node.op == Op::Call1 ? 1 : node.b;
+                    args.clear();
+                    for (size_t arg = 0; arg < argc; arg++) {
+                        args.push_back(remap[node.op == Op::Call1 ? node.a : operands[node.a + arg]]);
+                    }
+                    remap[i] = target->emitCall(*node.function, *node.name, args, node.position);
+                    break;
+                }
+                default:
+                    remap[i] = target->emitBinary(node.op, remap[node.a], remap[node.b]);
+                    break;
+            }
+        }
+        for (uint32_t root : roots) {
+            target->outputs.push_back(remap[root]);
+        }
+        return target;
+    }
+
+    /**
+     * @brief Operations run by the reductions for the current size of their arrays: the element-wise
+     * program once per element, nested reductions once. Saturates instead of wrapping around
+     */
+    [[nodiscard]] auto reductionOperations() const -> size_t {
+        constexpr size_t max   = std::numeric_limits<size_t>::max();
+        size_t           total = 0;
+        for (const ReductionNode &reduction : reductions) {
+            const CompiledExpression &elements = *reduction.program;
+            size_t                    rows     = elements.arrays.empty() ? 0 : elements.arrays[0]->size;
+            size_t                    perRow   = std::max<size_t>(elements.cost.operations, 1);
+            size_t                    nested   = elements.reductionOperations();
+            if (rows > (max - total) / perRow || nested > max - total - rows * perRow) {
+                return max;
+            }
+            total += rows * perRow + nested;
+        }
+        return total;
+    }
+
+    /**
+     * @brief Sets the deadline checked by the reductions of the program, and by nested ones
+     */
+    auto limitReductions(std::chrono::steady_clock::time_point limit) -> void {
+        for (ReductionNode &reduction : reductions) {
+            reduction.program->deadline = limit;
+            reduction.program->limitReductions(limit);
+        }
+    }
+
+    static auto fold(Op op, number_t a, number_t b) -> number_t {
+        switch (op) {
+            case Op::Add:
+                return a + b;
+            case Op::Subtract:
+                return a - b;
+            case Op::Multiply:
+                return a * b;
+            default:
+                return a / b;
+        }
+    }
+
+    /**
+     * @brief Calls `visit` with a reference to every operand of the node
+     */
+    template <typename Visitor>
+    auto forEachOperand(Node &node, Visitor visit) -> void {
+        switch (node.op) {
+            case Op::Constant:
+            case Op::Load:
+            case Op::Element:
+            case Op::Reduce:
+                break;
+            case Op::Call:
+                for (uint32_t arg = 0; arg < node.b; arg++) {
+                    visit(operands[node.a + arg]);
+                }
+                break;
+            case Op::Negate:
+            case Op::Call1:
+                visit(node.a);
+                break;
+            case Op::MultiplyAdd:
+                visit(node.a);
+                visit(node.b);
+                visit(node.c);
+                break;
+            default:
+                visit(node.a);
+                visit(node.b);
+                break;
+        }
+    }
+
+    /**
+     * @brief Removes nodes not reachable from the outputs, like constants consumed by folding
+     */
+    auto compact() -> void {
+        std::vector<uint32_t> remap(nodes.size(), invalidNode);
+        for (uint32_t output : outputs) {
+            if (output != invalidNode) {
+                remap[output] = 0;
+            }
+        }
+        // Operands always precede their users, so a reverse pass finds every reachable node
+        for (size_t i = nodes.size(); i-- > 0;) {
+            if (remap[i] != invalidNode) {
+                forEachOperand(nodes[i], [&remap](uint32_t &operand) { remap[operand] = 0; });
+            }
+        }
+
+        std::vector<Node>     liveNodes;
+        std::vector<uint32_t> liveOperands;
+        std::vector<number_t> liveSlots;
+        for (size_t i = 0; i < nodes.size(); i++) {
+            if (remap[i] == invalidNode) {
+                continue;
+            }
+            remap[i]  = static_cast<uint32_t>(liveNodes.size());
+            Node node = nodes[i];
+            if (node.op == Op::Call) {
+                auto first = static_cast<uint32_t>(liveOperands.size());
+                for (uint32_t arg = 0; arg < node.b; arg++) {
+                    liveOperands.push_back(remap[operands[node.a + arg]]);
+                }
+                node.a = first;
+            } else {
+                forEachOperand(node, [&remap](uint32_t &operand) { operand = remap[operand]; });
+            }
+            liveNodes.push_back(node);
+            liveSlots.push_back(slots[i]);
+        }
+        for (uint32_t &output : outputs) {
+            if (output != invalidNode) {
+                output = remap[output];
+            }
+        }
+        nodes    = std::move(liveNodes);
+        operands = std::move(liveOperands);
+        slots    = std::move(liveSlots);
+
+        // Keys hold the operands of the interned nodes, so programs can keep growing afterwards
+        std::map<Key, uint32_t> liveInterned;
+        for (const auto &entry : interned) {
+            if (remap[entry.second] == invalidNode) {
+                continue;
+            }
+            Key key = entry.first;
+            Op  op  = std::get<0>(key);
+            if (op == Op::Negate) {
+                std::get<2>(key) = remap[std::get<2>(key)];
+            } else if (op != Op::Constant && op != Op::Load && op != Op::Element && op != Op::Call) {
+                std::get<2>(key) = remap[std::get<2>(key)];
+                std::get<3>(key) = remap[std::get<3>(key)];
+            }
+            for (uint32_t &arg : std::get<4>(key)) {
+                arg = remap[arg];
+            }
+            liveInterned.emplace(std::move(key), remap[entry.second]);
+        }
+        interned = std::move(liveInterned);
+    }
+
+    /**
+     * @brief Runs every node with the current values of variables and units
+     *
+     * @param failures When null, the first error stops the evaluation and is returned. Otherwise
+     * failing calls are flagged in it, so independent outputs of a list can still be used
+     */
+    auto execute(std::vector<uint8_t> *failures = nullptr) -> Result {
+        number_t *slot = slots.data();
+        size_t    size = nodes.size();
+        for (size_t i = 0; i < size; i++) {
+            const Node &node = nodes[i];
+            switch (node.op) {
+                case Op::Constant:
+                    break;
+                case Op::Load:
+                    slot[i] = *node.source;
+                    break;
+                case Op::Negate:
+                    slot[i] = -slot[node.a];
+                    break;
+                case Op::Add:
+                    slot[i] = slot[node.a] + slot[node.b];
+                    break;
+                case Op::Subtract:
+                    slot[i] = slot[node.a] - slot[node.b];
+                    break;
+                case Op::Multiply:
+                    slot[i] = slot[node.a] * slot[node.b];
+                    break;
+                case Op::Divide:
+                    slot[i] = slot[node.a] / slot[node.b];
+                    break;
+                case Op::MultiplyAdd:
+                    slot[i] = slot[node.a] * slot[node.b] + slot[node.c];
+                    break;
+                case Op::Call1:
+                    slot[i] = node.function->f1(slot[node.a]);
+                    break;
+                case Op::Call: {
+                    argument_list_t arguments{};
+                    const uint32_t *args = operands.data() + node.a;
+                    for (uint32_t arg = 0; arg < node.b; arg++) {
+                        arguments[arg] = slot[args[arg]];
+                    }
+                    Result ret = node.function->call(node.b, arguments);
+                    if (PM_UNLIKELY(ret.isError())) {
+                        if (failures == nullptr) {
+                            return callError(node, ret.getError());
+                        }
+                        failures->resize(size);
+                        (*failures)[i] = 1;
+                    }
+                    slot[i] = ret.getResult();
+                    break;
+                }
+                case Op::Element:
+                    // Only read by executeBatch
+                    break;
+                case Op::Reduce: {
+                    Result ret = runReduction(reductions[node.a]);
+                    if (PM_UNLIKELY(ret.isError())) {
+                        if (failures == nullptr) {
+                            return ret;
+                        }
+                        failures->resize(size);
+                        (*failures)[i] = 1;
+                    }
+                    slot[i] = ret.getResult();
+                    break;
+                }
+            }
+        }
+        return {};
+    }
+
+    static auto runReduction(const ReductionNode &reduction) -> Result {
+        return reduction.program->reduce(reduction.kind, reduction.summation, reduction.name, reduction.position);
+    }
+
+    /**
+     * @brief Error of a failing call, located like the errors of direct evaluation
+     */
+    static auto callError(const Node &node, const char *error) -> Result {
+        return {"In character " + std::to_string(node.position) + ": " + error + " `" + *node.name + '`'};
+    }
+
+    /**
+     * @brief Evaluates the element-wise program of a reduction over its arrays, one block at a time.
+     * Arrays are read in place, so only operations write block sized columns
+     */
+    auto reduce(Reduction kind, Summation summation, std::string_view name, uint32_t position) -> Result {
+        const char *invalid = nullptr;
+        size_t      rows    = arrays.empty() ? 0 : arrays[0]->size;
+        for (const ArrayView *array : arrays) {
+            invalid = array->size != rows ? "Arrays of different sizes in `" : invalid;
+        }
+        if (arrays.empty()) {
+            invalid = "Expected an array in `";
+        } else if (rows == 0 && kind != Reduction::Sum && kind != Reduction::Dot) {
+            invalid = "Empty array in `";
+        }
+        if (PM_UNLIKELY(invalid != nullptr)) {
+            return {"In character " + std::to_string(position) + ": " + invalid + std::string(name) + '`'};
+        }
+        Result ret = prepareBatch(nullptr, 0);
+        if (PM_UNLIKELY(ret.isError())) {
+            return ret;
+        }
+        Accumulator accumulator(kind, summation);
+        for (size_t start = 0; start < rows; start += PM_BATCH_SIZE) {
+            size_t count = std::min(rows - start, static_cast<size_t>(PM_BATCH_SIZE));
+            ret          = executeBatch(start, count);
+            if (PM_UNLIKELY(ret.isError())) {
+                return ret;
+            }
+            accumulator.add(batchColumns[outputs[0]], count);
+            if (PM_UNLIKELY(deadline != std::chrono::steady_clock::time_point::max() &&
+                            std::chrono::steady_clock::now() >= deadline)) {
+                return {"Deadline exceeded", ErrorKind::BudgetExceeded};
+            }
+        }
+        return accumulator.result();
+    }
+
+    /**
+     * @brief Checks whether a reduction of the program, or of a nested one, reads the variable
+     */
+    [[nodiscard]] auto reductionsRead(const number_t *variable) const -> bool {
+        for (const ReductionNode &reduction : reductions) {
+            for (const Node &node : reduction.program->nodes) {
+                if (node.op == Op::Load && node.source == variable) {
+                    return true;
+                }
+            }
+            if (reduction.program->reductionsRead(variable)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    template <typename Operation>
+    PM_INLINE static void mapColumns(number_t *dst, const number_t *a, const number_t *b, size_t rows,
+                                     Operation operation) {
+        for (size_t row = 0; row < rows; row++) {
+            dst[row] = operation(a[row], b[row]);
+        }
+    }
+
+    auto executeBatch(size_t start, size_t rows) -> Result {
+        size_t size = nodes.size();
+        for (size_t i = 0; i < size; i++) {
+            const Node &    node = nodes[i];
+            number_t *      dst  = &batchSlots[i * PM_BATCH_SIZE];
+            const number_t *a    = nullptr;
+            const number_t *b    = nullptr;
+            if (node.op >= Op::Negate && node.op <= Op::Divide) {
+                a = batchColumns[node.a];
+                b = batchColumns[node.op == Op::Negate ? node.a : node.b];
+            }
+            switch (node.op) {
+                case Op::Constant:
+                    break;
+                case Op::Load:
+                    if (batchInputs[i] != nullptr) {
+                        batchColumns[i] = batchInputs[i] + start;
+                    }
+                    break;
+                case Op::Element:
+                    batchColumns[i] = arrays[node.a]->data + start;
+                    break;
+                case Op::Reduce:
+                    break;
+                case Op::Negate:
+                    for (size_t row = 0; row < rows; row++) {
+                        dst[row] = -a[row];
+                    }
+                    break;
+                case Op::Add:
+                    mapColumns(dst, a, b, rows, [](number_t x, number_t y) { return x + y; });
+                    break;
+                case Op::Subtract:
+                    mapColumns(dst, a, b, rows, [](number_t x, number_t y) { return x - y; });
+                    break;
+                case Op::Multiply:
+                    mapColumns(dst, a, b, rows, [](number_t x, number_t y) { return x * y; });
+                    break;
+                case Op::Divide:
+                    mapColumns(dst, a, b, rows, [](number_t x, number_t y) { return x / y; });
+                    break;
+                case Op::MultiplyAdd: {
+                    const number_t *x = batchColumns[node.a];
+                    const number_t *y = batchColumns[node.b];
+                    const number_t *z = batchColumns[node.c];
+                    for (size_t row = 0; row < rows; row++) {
+                        dst[row] = x[row] * y[row] + z[row];
+                    }
+                    break;
+                }
+                case Op::Call1: {
+                    const number_t *x = batchColumns[node.a];
+                    for (size_t row = 0; row < rows; row++) {
+                        dst[row] = node.function->f1(x[row]);
+                    }
+                    break;
+                }
+                case Op::Call: {
+                    // Arguments of the whole block are ready, so the function is invoked once per block
+                    std::array<const number_t *, PM_MAX_ARGUMENTS> arguments{};
+                    const uint32_t *                               args = operands.data() + node.a;
+                    for (uint32_t arg = 0; arg < node.b; arg++) {
+                        arguments[arg] = batchColumns[args[arg]];
+                    }
+                    Result ret = node.function->callBulk(node.b, arguments.data(), rows, dst);
+                    if (PM_UNLIKELY(ret.isError())) {
+                        return callError(node, ret.getError());
+                    }
+                    break;
+                }
+            }
+        }
+        return {};
+    }
+
+  public:
+    /**
+     * @brief Values of one variable for every row of a batch
+     */
+    struct Column {
+        const number_t *variable; // Reference returned by PicoMath::addVariable
+        const number_t *values;   // One value per row
+    };
+
+    /**
+     * @brief Range of values that one variable or unit can take, for interval analysis
+     */
+    struct Range {
+        const number_t *variable; // Reference returned by PicoMath::addVariable or PicoMath::addUnit
+        Interval        interval;
+    };
+
+  private:
+    /**
+     * @brief Allocates one column per node and fills the columns that don't change between blocks
+     */
+    auto prepareBatch(const Column *columns, size_t columnCount) -> Result {
+        size_t size = nodes.size();
+        batchSlots.resize(size * PM_BATCH_SIZE);
+        batchColumns.resize(size);
+        batchInputs.assign(size, nullptr);
+        for (size_t i = 0; i < size; i++) {
+            const Node &node   = nodes[i];
+            number_t *  column = &batchSlots[i * PM_BATCH_SIZE];
+            batchColumns[i]    = column;
+            if (node.op == Op::Load) {
+                for (size_t c = 0; c < columnCount; c++) {
+                    if (columns[c].variable == node.source) {
+                        batchInputs[i] = columns[c].values;
+                    }
+                }
+                if (batchInputs[i] == nullptr) {
+                    // Same value for every row
+                    std::fill(column, column + PM_BATCH_SIZE, *node.source);
+                }
+            } else if (node.op == Op::Constant) {
+                std::fill(column, column + PM_BATCH_SIZE, slots[i]);
+            } else if (node.op == Op::Reduce) {
+                // Reductions don't depend on the row
+                Result ret = runReduction(reductions[node.a]);
+                if (PM_UNLIKELY(ret.isError())) {
+                    return ret;
+                }
+                std::fill(column, column + PM_BATCH_SIZE, ret.getResult());
+            }
+        }
+        return {};
+    }
+
+    /**
+     * @brief Checks whether a Load reads a constant of the shared built-in layer, like `pi`.
+     * They can't be changed, so they are known without a range.
+     */
+    static auto isBuiltinConstant(const number_t *source) -> bool {
+        for (const auto &entry : PicoMath::builtins()->variables) {
+            if (&entry.second == source) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    /**
+     * @brief Computes an interval for every node, in program order
+     *
+     * @param current Variables without a range take their current value, instead of any value
+     */
+    [[nodiscard]] auto intervals(const Range *ranges, size_t rangeCount, bool current) const
+        -> std::vector<Interval> {
+        std::vector<Interval>                  result(nodes.size());
+        std::array<Interval, PM_MAX_ARGUMENTS> args{};
+        for (size_t i = 0; i < nodes.size(); i++) {
+            const Node &node = nodes[i];
+            switch (node.op) {
+                case Op::Constant:
+                    result[i] = Interval::point(slots[i]);
+                    break;
+                case Op::Load:
+                    result[i] = current || isBuiltinConstant(node.source) ? Interval::point(*node.source)
+                                                                          : Interval::unbounded();
+                    for (size_t r = 0; r < rangeCount; r++) {
+                        if (ranges[r].variable == node.source) {
+                            result[i] = ranges[r].interval;
+                        }
+                    }
+                    break;
+                case Op::Negate:
+                    result[i] = -result[node.a];
+                    break;
+                case Op::Add:
+                    result[i] = result[node.a] + result[node.b];
+                    break;
+                case Op::Subtract:
+                    result[i] = result[node.a] - result[node.b];
+                    break;
+                case Op::Multiply:
+                    result[i] = result[node.a] * result[node.b];
+                    break;
+                case Op::Divide:
+                    result[i] = result[node.a] / result[node.b];
+                    break;
+                case Op::MultiplyAdd:
+                    // The compiler may fuse the multiply-add, rounding once instead of twice
+                    result[i] = (result[node.a] * result[node.b] + result[node.c]).widened(1);
+                    break;
+                case Op::Call1:
+                case Op::Call: {
+                    size_t argc = node.op == Op::Call1 ? 1 : node.b;
+                    for (size_t arg = 0; arg < argc; arg++) {
+                        args[arg] = result[node.op == Op::Call1 ? node.a : operands[node.a + arg]];
+                    }
+                    interval_function_t rule = node.function->interval;
+                    result[i]                = rule == nullptr ? Interval::unbounded() : rule(argc, args.data());
+                    break;
+                }
+                case Op::Element:
+                case Op::Reduce:
+                    result[i] = Interval::unbounded();
+                    break;
+            }
+        }
+        return result;
+    }
+
+    /**
+     * @brief Emits a call of a built-in `abs`, `min` or `max` without the arguments that can't change
+     * its result, given their intervals
+     */
+    auto emitPrunedCall(const Node &node, const std::vector<uint32_t> &args, const std::vector<Interval> &bounds)
+        -> uint32_t {
+        using Bounds             = PicoMath::Bounds;
+        interval_function_t rule = node.function->interval;
+        if (rule == &Bounds::abs && args.size() == 1) {
+            if (bounds[0].low > 0) {
+                return args[0];
+            }
+            if (bounds[0].high < 0) {
+                return emitNegate(args[0]);
+            }
+        }
+        bool isMin = rule == &Bounds::min;
+        bool isMax = rule == &Bounds::max;
+        bool nan   = false;
+        for (const Interval &bound : bounds) {
+            nan = nan || bound.maybeNaN;
+        }
+        if (!(isMin || isMax) || nan || args.empty()) {
+            return emitCall(*node.function, *node.name, args, node.position);
+        }
+        // An argument is never selected when another one is always strictly better
+        std::vector<uint32_t> kept;
+        size_t                last = 0;
+        for (size_t j = 0; j < args.size(); j++) {
+            bool dominated = false;
+            for (size_t k = 0; k < args.size(); k++) {
+                dominated = dominated || (isMin ? bounds[k].high < bounds[j].low : bounds[k].low > bounds[j].high);
+            }
+            if (!dominated) {
+                kept.push_back(args[j]);
+                last = j;
+            }
+        }
+        // A single argument is the result unless the initial value of the function is better
+        if (kept.size() == 1 && (isMin ? bounds[last].high <= std::numeric_limits<number_t>::max()
+                                       : bounds[last].low >= std::numeric_limits<number_t>::min())) {
+            return kept[0];
+        }
+        return emitCall(*node.function, *node.name, kept, node.position);
+    }
+
+  public:
+    [[nodiscard]] auto isError() const -> bool {
+        return error != nullptr;
+    }
+
+    [[nodiscard]] auto isOk() const -> bool {
+        return error == nullptr;
+    }
+
+    [[nodiscard]] auto getError() const -> const char * {
+        return error->c_str();
+    }
+
+    /**
+     * @brief Number of nodes of the program, after deduplication and constant folding
+     */
+    [[nodiscard]] auto size() const -> size_t {
+        return nodes.size();
+    }
+
+    /**
+     * @brief Static cost of evaluating the source directly, computed while compiling.
+     * It can be compared with a Budget to reject or deprioritize expensive expressions before
+     * evaluating them. The cost of an evaluation of the compiled program is given by size().
+     */
+    [[nodiscard]] auto getCost() const -> ExpressionCost {
+        return cost;
+    }
+
+    /**
+     * @brief Evaluates the program with the current values of variables and units
+     *
+     * @return Result Result containing the result value or an error
+     */
+    auto eval() -> Result {
+        if (PM_UNLIKELY(isError())) {
+            return {std::string(*error)};
+        }
+        if (PM_UNLIKELY(outputs.empty() || outputs[0] == invalidNode)) {
+            return {"Invalid expression"};
+        }
+        Result ret = execute();
+        if (PM_UNLIKELY(ret.isError())) {
+            return ret;
+        }
+        return {slots[outputs[0]]};
+    }
+
+    /**
+     * @brief Rewrites the program into a form that is faster to run but slower to build. Products
+     * used only by an addition become multiply-add nodes, and one argument functions without a
+     * result cache are called directly. Every operation keeps its rounding, so results don't change.
+     * Changing the cache or the type of a function afterwards requires compiling again.
+     */
+    auto specialize() -> void {
+        if (isError()) {
+            return;
+        }
+        std::vector<uint32_t> uses(nodes.size(), 0);
+        for (auto &node : nodes) {
+            forEachOperand(node, [&uses](uint32_t &operand) { uses[operand]++; });
+        }
+        for (uint32_t output : outputs) {
+            if (output != invalidNode) {
+                uses[output]++;
+            }
+        }
+        for (auto &node : nodes) {
+            if (node.op == Op::Call && node.function->type == PicoMath::Function::Type::Function1 &&
+                node.function->cache == nullptr) {
+                node.op = Op::Call1;
+                node.a  = operands[node.a];
+                node.b  = 0;
+            } else if (node.op == Op::Add) {
+                bool productA = nodes[node.a].op == Op::Multiply && uses[node.a] == 1;
+                bool productB = !productA && nodes[node.b].op == Op::Multiply && uses[node.b] == 1;
+                if (productA || productB) {
+                    const Node &product = nodes[productA ? node.a : node.b];
+                    node.c              = productA ? node.b : node.a;
+                    node.op             = Op::MultiplyAdd;
+                    node.a              = product.a;
+                    node.b              = product.b;
+                }
+            }
+        }
+        // The products merged into multiply-add nodes are no longer used
+        compact();
+        for (ReductionNode &reduction : reductions) {
+            reduction.program->specialize();
+        }
+    }
+
+    /**
+     * @brief Computes bounds of the result for every value of the variables inside their ranges.
+     * Variables and units without a range take their current value. Functions without an interval
+     * rule, and reductions, can return any value. Errors of function calls are not considered.
+     * Bounds are guaranteed but not tight: checking them against a threshold can avoid evaluating
+     * the program for every row, or show which rows need it.
+     *
+     * @param ranges Ranges of the variables
+     * @param rangeCount Number of ranges
+     * @return Interval Bounds of the first output. Unbounded if the program is invalid
+     */
+    [[nodiscard]] auto bound(const Range *ranges, size_t rangeCount) const -> Interval {
+        if (isError() || outputs.empty() || outputs[0] == invalidNode) {
+            return Interval::unbounded();
+        }
+        return intervals(ranges, rangeCount, true)[outputs[0]];
+    }
+
+    [[nodiscard]] auto bound(std::initializer_list<Range> ranges) const -> Interval {
+        return bound(ranges.begin(), ranges.size());
+    }
+
+    /**
+     * @brief Simplifies the program for variables that stay inside the given ranges. Other variables
+     * and units can take any value. Nodes that can only take one value, other than zero, become
+     * constants and are folded. Built-in `abs` of a value with a known sign is removed, as are
+     * arguments of built-in `min` and `max` that are never selected.
+     * Results only change if a variable leaves its range; calls that can't affect the result are
+     * dropped, together with their errors. Specialized programs are specialized again.
+     *
+     * @param ranges Ranges of the variables
+     * @param rangeCount Number of ranges
+     */
+    auto assume(const Range *ranges, size_t rangeCount) -> void {
+        if (isError()) {
+            return;
+        }
+        std::vector<Interval>          bounds       = intervals(ranges, rangeCount, false);
+        std::vector<Node>              oldNodes     = std::move(nodes);
+        std::vector<uint32_t>          oldOperands  = std::move(operands);
+        std::vector<number_t>          oldSlots     = std::move(slots);
+        std::vector<const ArrayView *> oldArrays    = std::move(arrays);
+        std::vector<ReductionNode>     oldReduction = std::move(reductions);
+        size_t                         oldRequested = requested;
+        nodes.clear();
+        operands.clear();
+        slots.clear();
+        arrays.clear();
+        reductions.clear();
+        interned.clear();
+
+        bool                  specialized = false;
+        std::vector<uint32_t> remap(oldNodes.size(), invalidNode);
+        std::vector<uint32_t> args;
+        std::vector<Interval> argBounds;
+        for (size_t i = 0; i < oldNodes.size(); i++) {
+            const Node &    node  = oldNodes[i];
+            const Interval &bound = bounds[i];
+            bool impure = (node.op == Op::Call || node.op == Op::Call1) && node.function->purity != Purity::Pure;
+            specialized = specialized || node.op == Op::MultiplyAdd || node.op == Op::Call1;
+            // The sign of a zero isn't tracked, so only other values are folded
+            if (node.op != Op::Constant && !impure && bound.isPoint() && (bound.low < 0 || bound.low > 0)) {
+                remap[i] = emitConstant(bound.low);
+                continue;
+            }
+            switch (node.op) {
+                case Op::Constant:
+                    remap[i] = internConstant(oldSlots[i]);
+                    break;
+                case Op::Load:
+                    remap[i] = emitLoad(node.source);
+                    break;
+                case Op::Negate:
+                    remap[i] = emitNegate(remap[node.a]);
+                    break;
+                case Op::MultiplyAdd:
+                    remap[i] = emitBinary(Op::Add, emitBinary(Op::Multiply, remap[node.a], remap[node.b]),
+                                          remap[node.c]);
+                    break;
+                case Op::Call1:
+                case Op::Call: {
+                    size_t argc = node.op == Op::Call1 ? 1 : node.b;
+                    args.clear();
+                    argBounds.clear();
+                    for (size_t arg = 0; arg < argc; arg++) {
+                        uint32_t operand = node.op == Op::Call1 ? node.a : oldOperands[node.a + arg];
+                        args.push_back(remap[operand]);
+                        argBounds.push_back(bounds[operand]);
+                    }
+                    remap[i] = emitPrunedCall(node, args, argBounds);
+                    break;
+                }
+                case Op::Element:
+                    remap[i] = emitElement(oldArrays[node.a]);
+                    break;
+                case Op::Reduce: {
+                    ReductionNode &reduction = oldReduction[node.a];
+                    remap[i] = emitReduce(reduction.kind, reduction.summation, reduction.name,
+                                          std::move(reduction.program), reduction.position);
+                    break;
+                }
+                default:
+                    remap[i] = emitBinary(node.op, remap[node.a], remap[node.b]);
+                    break;
+            }
+        }
+        for (uint32_t &output : outputs) {
+            if (output != invalidNode) {
+                output = remap[output];
+            }
+        }
+        requested = oldRequested;
+        compact();
+        if (specialized) {
+            specialize();
+        }
+    }
+
+    auto assume(std::initializer_list<Range> ranges) -> void {
+        assume(ranges.begin(), ranges.size());
     }
 
-    [[nodiscard]] PM_INLINE auto peek() const -> char {
-        return *str;
+    /**
+     * @brief Number of values produced by the program: one, or the number of items of a compiled list
+     */
+    [[nodiscard]] auto outputCount() const -> size_t {
+        return outputs.size();
     }
 
-    PM_INLINE void consumeSpace() {
-        while (*str == ' ' || *str == '\t' || *str == '\r' || *str == '\n') {
-            consume();
+    /**
+     * @brief Evaluates every item of a compiled list into a caller provided buffer.
+     * Items that failed to compile, or that depend on a failing function call, are flagged in the
+     * error bitmap and their value is zero.
+     *
+     * @param out Output values, with room for `capacity` values
+     * @param capacity Maximum number of items to write
+     * @param errors Bitmap with one bit per item, with room for `(capacity + 63) / 64` words
+     * @return size_t Number of items written
+     */
+    auto evalList(number_t *out, size_t capacity, uint64_t *errors) -> size_t {
+        size_t count = std::min(capacity, outputs.size());
+        failed.clear();
+        execute(&failed);
+        if (PM_UNLIKELY(!failed.empty())) {
+            // A node fails when any of its operands fails. Operands precede their users
+            for (size_t i = 0; i < nodes.size(); i++) {
+                forEachOperand(nodes[i], [this, i](uint32_t &operand) { failed[i] |= failed[operand]; });
+            }
+        }
+        for (size_t item = 0; item < count; item++) {
+            uint32_t node    = outputs[item];
+            bool     invalid = node == invalidNode || (!failed.empty() && failed[node] != 0);
+            out[item]        = invalid ? 0 : slots[node];
+            if (invalid) {
+                errors[item / 64] |= uint64_t{1} << (item % 64);
+            } else {
+                errors[item / 64] &= ~(uint64_t{1} << (item % 64));
+            }
         }
+        return count;
     }
 
-    [[nodiscard]] PM_INLINE auto isDigit() const -> bool {
-        return *str >= '0' && *str <= '9';
+    /**
+     * @brief Evaluates the program for many rows, in blocks of PM_BATCH_SIZE rows.
+     * Variables with a column take one value per row, the rest keep their current value. Every
+     * node is evaluated for a whole block before the next one, so functions added with the bulk
+     * overload are invoked once per block.
+     *
+     * @param rows Number of rows
+     * @param columns Columns of the variables that change per row
+     * @param columnCount Number of columns
+     * @param out Output with room for `rows` values
+     * @return Result Empty result, or the first error. Rows of previous blocks are already written
+     */
+    auto evalBatch(size_t rows, const Column *columns, size_t columnCount, number_t *out) -> Result {
+        if (PM_UNLIKELY(isError())) {
+            return {std::string(*error)};
+        }
+        if (PM_UNLIKELY(outputs.empty() || outputs[0] == invalidNode)) {
+            return {"Invalid expression"};
+        }
+        for (size_t c = 0; c < columnCount; c++) {
+            if (PM_UNLIKELY(reductionsRead(columns[c].variable))) {
+                return {"Variables with a column can't be used inside reductions"};
+            }
+        }
+        Result ret = prepareBatch(columns, columnCount);
+        if (PM_UNLIKELY(ret.isError())) {
+            return ret;
+        }
+
+        for (size_t start = 0; start < rows; start += PM_BATCH_SIZE) {
+            size_t count = std::min(rows - start, static_cast<size_t>(PM_BATCH_SIZE));
+            ret          = executeBatch(start, count);
+            if (PM_UNLIKELY(ret.isError())) {
+                return ret;
+            }
+            const number_t *result = batchColumns[outputs[0]];
+            std::copy(result, result + count, out + start);
+        }
+        return {};
     }
 
-    [[nodiscard]] PM_INLINE auto isAlpha() const -> bool {
-        return (*str >= 'a' && *str <= 'z') || (*str >= 'A' && *str <= 'Z') || (*str == '_');
+    auto evalBatch(size_t rows, std::initializer_list<Column> columns, number_t *out) -> Result {
+        return evalBatch(rows, columns.begin(), columns.size(), out);
     }
+};
 
-    [[nodiscard]] PM_INLINE auto isUnitChar() const -> bool {
-        return isAlpha() || *str == '%';
+/**
+ * @brief Parses an expression with the same grammar as Expression, emitting nodes instead of
+ * evaluating them
+ */
+class Compiler : Scanner {
+    friend PicoMath;
+    template <bool>
+    friend class BasicExpression;
+    friend RuleSet;
+
+    static constexpr uint32_t invalidNode = CompiledExpression::invalidNode;
+    using Op                              = CompiledExpression::Op;
+
+    const PicoMath &    context;
+    CompiledExpression &program;
+    std::string         error{};
+    size_t              depth{0};
+    bool                elementwise{false}; // Compiling the arguments of a reduction, arrays are allowed
+    size_t              arrayReads{0};      // Arrays read by the source, not yet consumed by a reduction
+
+    // Size of the program before the arguments of a call, to move them into a reduction
+    struct Mark {
+        size_t nodes;
+        size_t operands;
+        size_t requested;
+        size_t operations;
+        size_t calls;
+        size_t arrayReads;
+    };
+
+    Compiler(const PicoMath &picomathContext, CompiledExpression &target, const char *expression)
+        : Scanner(expression), context(picomathContext), program(target) {
     }
 
-    [[nodiscard]] PM_INLINE auto isEOF() const -> bool {
-        return *str == 0;
+    auto compileSingle() -> uint32_t {
+        uint32_t node = compileExpression();
+        if (PM_UNLIKELY(node == invalidNode)) {
+            return node;
+        }
+        consumeSpace();
+        if (PM_LIKELY(isEOF())) {
+            return node;
+        }
+        return generateError("Invalid characters after expression");
     }
 
-    [[nodiscard]] PM_INLINE auto isSign() const -> bool {
-        return *str == '+' || *str == '-';
+    auto compileList() -> void {
+        consumeSpace();
+        while (!isEOF()) {
+            const char *start = str;
+            uint32_t    item  = compileExpression();
+            consumeSpace();
+            if (PM_UNLIKELY(item == invalidNode || (peek() != ',' && !isEOF()))) {
+                item = invalidNode;
+                skipItem(start);
+            }
+            program.outputs.push_back(item);
+            if (peek() == ',') {
+                consume();
+                consumeSpace();
+            }
+        }
     }
 
-    [[nodiscard]] PM_INLINE auto isExponent() const -> bool {
-        // This doesn't read out of bounds because:
-        // if first character is 'e' or 'E', next character can be a valid character
-        // or zero if it's the end of the string
-        return (*str == 'e' || *str == 'E') &&
-               (*(str + 1) == '+' || *(str + 1) == '-' || (*(str + 1) >= '0' && *(str + 1) <= '9'));
+    auto generateError(const char *message, std::string_view identifier = {}) -> uint32_t {
+        error = describeError(message, identifier);
+        return invalidNode;
     }
 
-    PM_INLINE auto parseFunction(std::string_view identifier) noexcept -> Result {
-        auto f = context.functions.find(identifier);
-        if (PM_UNLIKELY(f == context.functions.end())) {
-            return generateError("Unknown function", identifier);
+    auto compileExpression() -> uint32_t {
+        consumeSpace();
+        if (PM_UNLIKELY(isEOF())) {
+            return generateError("Unexpected end of the string");
         }
+        return compileAddition();
+    }
 
+    /**
+     * @brief Compiles the arguments of a call, starting at its '('
+     *
+     * @return false The arguments are invalid, the error is set
+     */
+    auto compileArguments(std::vector<uint32_t> &arguments) -> bool {
         // Consume '('
         consume();
         consumeSpace();
-
-        std::array<number_t, PM_MAX_ARGUMENTS> arguments{};
-        size_t                                 argc = 0;
-
         if (peek() != ')') {
             while (true) {
-                if (PM_UNLIKELY(argc == PM_MAX_ARGUMENTS)) {
-                    return generateError("Too many arguments");
+                if (PM_UNLIKELY(arguments.size() == PM_MAX_ARGUMENTS)) {
+                    generateError("Too many arguments");
+                    return false;
                 }
-                Result argument = evalExpression();
-                if (PM_UNLIKELY(argument.isError())) {
-                    return argument;
+                uint32_t argument = compileExpression();
+                if (PM_UNLIKELY(argument == invalidNode)) {
+                    return false;
                 }
-                arguments[argc] = argument.result;
-                argc++;
+                arguments.push_back(argument);
                 consumeSpace();
                 if (peek() != ',') {
                     break;
@@ -360,31 +3358,84 @@ class Expression {
                 consume();
             }
         }
-
         if (PM_UNLIKELY(peek() != ')')) {
-            return generateError("Expected ')'");
+            generateError("Expected ')'");
+            return false;
         }
         consume();
+        return true;
+    }
 
-        if (f->second.type == PicoMath::Function::Type::Function1) {
-            if (PM_UNLIKELY(argc != 1)) {
-                return generateError("One argument required");
-            }
-            return {f->second.f1(arguments[0])};
+    /**
+     * @brief Moves the arguments of a call that read arrays into the element-wise program of a
+     * reduction. `dot(a, b)` is compiled as the products of its arguments, added like `sum`
+     */
+    auto compileReduction(CompiledExpression::Reduction kind, std::string_view identifier,
+                          const std::vector<uint32_t> &arguments, const Mark &mark) -> uint32_t {
+        size_t expected = kind == CompiledExpression::Reduction::Dot ? 2 : 1;
+        if (PM_UNLIKELY(arguments.size() != expected)) {
+            return generateError(expected == 1 ? "One argument required" : "Two arguments required");
         }
-        Result ret = f->second.many(argc, arguments);
-        if (PM_UNLIKELY(ret.isError())) {
-            // Improve information in errors generated inside functions
-            return generateError(ret.getError(), identifier);
+        std::unique_ptr<CompiledExpression> reduction = program.extract(arguments);
+        program.rollback(mark.nodes, mark.operands);
+        program.requested = mark.requested;
+
+        CompiledExpression &elements = *reduction;
+        uint32_t            output   = expected == 2
+                                           ? elements.emitBinary(Op::Multiply, elements.outputs[0], elements.outputs[1])
+                                           : elements.outputs[0];
+        elements.outputs.assign(1, output);
+        elements.compact();
+        elements.interned.clear();
+        // The arguments stay counted once in the cost of the program, like in direct evaluation
+        elements.cost.operations = program.cost.operations - mark.operations;
+        elements.cost.calls      = program.cost.calls - mark.calls;
+        auto position = static_cast<uint32_t>(errorPosition());
+        return program.emitReduce(kind, context.summation, identifier, std::move(reduction), position);
+    }
+
+    auto compileFunction(std::string_view identifier) -> uint32_t {
+        // Calls of reduction names are reductions when their arguments read an array
+        CompiledExpression::Reduction reduction{};
+        bool reducible = PM_UNLIKELY(context.hasArrays()) && CompiledExpression::findReduction(identifier, reduction);
+        auto f         = context.findFunction(identifier);
+        if (PM_UNLIKELY(f == nullptr && !reducible)) {
+            return generateError("Unknown function", identifier);
         }
-        return ret;
+
+        Mark mark{program.nodes.size(), program.operands.size(), program.requested, program.cost.operations,
+                  program.cost.calls, arrayReads};
+        bool                  outside = !elementwise;
+        std::vector<uint32_t> arguments;
+        elementwise = elementwise || reducible;
+        bool valid  = compileArguments(arguments);
+        elementwise = !outside;
+        if (PM_UNLIKELY(!valid)) {
+            return invalidNode;
+        }
+        if (reducible && arrayReads > mark.arrayReads) {
+            // The arrays are consumed by this reduction, an enclosing call is not a reduction because of them
+            arrayReads = mark.arrayReads;
+            return compileReduction(reduction, identifier, arguments, mark);
+        }
+        if (PM_UNLIKELY(f == nullptr)) {
+            return generateError("Unknown function", identifier);
+        }
+
+        if (f->second.type == PicoMath::Function::Type::Function1 && PM_UNLIKELY(arguments.size() != 1)) {
+            return generateError("One argument required");
+        }
+        program.cost.calls++;
+        // Same position as the errors of direct evaluation: the closing parenthesis
+        auto position = static_cast<uint32_t>(errorPosition());
+        return program.emitCall(f->second, f->first, arguments, position);
     }
 
-    PM_INLINE auto parseParenthesized() -> Result {
+    auto compileParenthesized() -> uint32_t {
         consume();
         consumeSpace();
-        Result exp = evalExpression();
-        if (PM_UNLIKELY(exp.isError())) {
+        uint32_t exp = compileExpression();
+        if (PM_UNLIKELY(exp == invalidNode)) {
             return exp;
         }
         consumeSpace();
@@ -396,182 +3447,339 @@ class Expression {
         return exp;
     }
 
-    auto parsePrefixUnaryOperator() -> Result {
+    auto compilePrefixUnaryOperator() -> uint32_t {
         char op = consume();
         consumeSpace();
-        Result unary = parseSubExpression();
-        if (PM_UNLIKELY(unary.isError())) {
+        uint32_t unary = compileSubExpression();
+        if (PM_UNLIKELY(unary == invalidNode)) {
             return unary;
         }
         if (op == '-') {
-            unary.result = -unary.result;
+            return program.emitNegate(unary);
         }
         return unary;
     }
 
-    PM_INLINE auto parseVariableOrFunction() noexcept -> Result {
-        const char *start = str;
-        size_t      size  = 0;
-        do {
-            consume();
-            size++;
-        } while (isAlpha());
-
-        std::string_view identifier{start, size};
+    auto compileVariableOrFunction() -> uint32_t {
+        std::string_view identifier = scanIdentifier();
         consumeSpace();
         if (peek() == '(') {
             // function call
-            return parseFunction(identifier);
+            return compileFunction(identifier);
         }
-        auto f = context.variables.find(identifier);
-        if (PM_UNLIKELY(f == context.variables.end())) {
-            return generateError("Unknown variable", identifier);
+        auto f = context.findVariable(identifier);
+        if (PM_UNLIKELY(f == nullptr)) {
+            auto array = context.findArray(identifier);
+            if (array == nullptr) {
+                return generateError("Unknown variable", identifier);
+            }
+            if (PM_UNLIKELY(!elementwise)) {
+                return generateError("Array used outside of a reduction", identifier);
+            }
+            arrayReads++;
+            return program.emitElement(&array->second);
         }
-        return {f->second};
+        return program.emitLoad(&f->second);
     }
 
-    PM_INLINE auto parseNumber() noexcept -> Result {
-        number_t ret = 0;
-
-#if defined(PM_USE_PRECISE_FLOAT_PARSING)
-        char *end;
-        ret = PM_STR_TO_FLOAT(str, &end);
-        if (PM_UNLIKELY(errno == ERANGE)) {
-            std::string_view identifier{str, static_cast<size_t>(end - str)};
-            return generateError("Float out of range", identifier);
-        }
-        str = end;
-#else
-        while (PM_LIKELY(isDigit())) {
-            ret = ret * 10 + (*str - '0');
-            consume();
-        }
-        // Decimal point
-        if (peek() == '.') {
-            consume();
-            number_t weight = 1;
-            while (isDigit()) {
-                weight /= 10;
-                ret += (*str - '0') * weight;
-                consume();
-            }
-        }
-        if (PM_UNLIKELY(isExponent())) {
-            consume();
-            bool sign = false;
-            if (isSign()) {
-                if (consume() == '-') {
-                    sign = true;
-                }
-            }
-            int exp = 0;
-            while (PM_LIKELY(isDigit())) {
-                exp = exp * 10 + (*str - '0');
-                consume();
-            }
-            ret *= std::pow(static_cast<number_t>(10), sign ? -exp : exp);
+    auto compileNumber() -> uint32_t {
+        number_t         value = 0;
+        std::string_view literal;
+        if (PM_UNLIKELY(!scanNumber(value, literal))) {
+            return generateError("Float out of range", literal);
         }
-#endif
+        uint32_t number = program.emitConstant(value);
+
         // Space before units
         consumeSpace();
 
         // Units and percentage
         if (isUnitChar()) {
-            const char *start = str;
-            size_t      size  = 0;
-            do {
-                consume();
-                size++;
-            } while (isUnitChar());
+            std::string_view identifier = scanUnit();
 
-            std::string_view identifier{start, size};
-
-            auto f = context.units.find(identifier);
-            if (PM_UNLIKELY(f == context.units.end())) {
+            auto f = context.findUnit(identifier);
+            if (PM_UNLIKELY(f == nullptr)) {
                 return generateError("Unknown unit", identifier);
             }
-            ret = ret * f->second;
+            // Units can change between evaluations, so they are loaded like variables
+            return program.emitBinary(Op::Multiply, number, program.emitLoad(&f->second));
         }
-        return ret;
+        return number;
     }
 
-    PM_INLINE auto parseSubExpression() -> Result {
+    /**
+     * @brief Compiles an operand, counting it in the cost like Expression counts it in the budget
+     */
+    auto compileSubExpression() -> uint32_t {
+        program.cost.operations++;
+        depth++;
+        program.cost.depth = std::max(program.cost.depth, depth);
+        uint32_t node      = compileOperand();
+        depth--;
+        return node;
+    }
+
+    auto compileOperand() -> uint32_t {
         if (isDigit() || peek() == '.') {
             // Number
-            return parseNumber();
+            return compileNumber();
         }
         if (peek() == '(') {
             // Parenthesized expression
-            return parseParenthesized();
+            return compileParenthesized();
         }
         if (peek() == '-' || peek() == '+') {
             // Prefix unary operator
-            return parsePrefixUnaryOperator();
+            return compilePrefixUnaryOperator();
         }
         if (isAlpha()) {
             // Variable or function
-            return parseVariableOrFunction();
+            return compileVariableOrFunction();
         }
         return generateError("Invalid character");
     }
 
-    auto parseAddition() -> Result {
+    auto compileAddition() -> uint32_t {
         consumeSpace();
-        Result left = parseMultiplication();
-        if (PM_UNLIKELY(left.isError())) {
+        uint32_t left = compileMultiplication();
+        if (PM_UNLIKELY(left == invalidNode)) {
             return left;
         }
         consumeSpace();
         while (*str == '+' || *str == '-') {
             char op = consume();
             consumeSpace();
-            Result right = parseMultiplication();
-            if (PM_UNLIKELY(right.isError())) {
+            uint32_t right = compileMultiplication();
+            if (PM_UNLIKELY(right == invalidNode)) {
                 return right;
             }
-            if (op == '+') {
-                left.result += right.result;
-            } else {
-                left.result -= right.result;
-            }
+            left = program.emitBinary(op == '+' ? Op::Add : Op::Subtract, left, right);
             consumeSpace();
         }
         return left;
     }
 
-    auto parseMultiplication() -> Result {
+    auto compileMultiplication() -> uint32_t {
         consumeSpace();
-        Result left = parseSubExpression();
-        if (PM_UNLIKELY(left.isError())) {
+        uint32_t left = compileSubExpression();
+        if (PM_UNLIKELY(left == invalidNode)) {
             return left;
         }
         consumeSpace();
         while (*str == '*' || *str == '/') {
             char op = consume();
             consumeSpace();
-            Result right = parseSubExpression();
-            if (PM_UNLIKELY(right.isError())) {
+            uint32_t right = compileSubExpression();
+            if (PM_UNLIKELY(right == invalidNode)) {
                 return right;
             }
-            if (op == '*') {
-                left.result *= right.result;
-            } else if (op == '/') {
-                left.result /= right.result;
-            }
+            left = program.emitBinary(op == '*' ? Op::Multiply : Op::Divide, left, right);
             consumeSpace();
         }
         return left;
     }
 };
 
+/**
+ * @brief Statistics of the deduplication of a rule set
+ */
+struct RuleSetStats {
+    size_t rules{0};      // Rules in the set
+    size_t requested{0};  // Operations, variable reads and literals of all the rules, as written
+    size_t nodes{0};      // Nodes of the shared program, after deduplication and constant folding
+    size_t evaluated{0};  // Nodes computed for each record: variable reads, operations and calls
+
+    /**
+     * @brief Fraction of the written operations that are not computed per record
+     */
+    [[nodiscard]] auto savedRatio() const -> double {
+        return requested == 0 ? 0.0 : 1.0 - static_cast<double>(evaluated) / static_cast<double>(requested);
+    }
+};
+
+/**
+ * @brief Many formulas compiled together into a single program.
+ * Identical subexpressions are interned across all the rules, so each one is computed once per
+ * record, and every variable is read once. Rules are bound to the context like a CompiledExpression,
+ * so the context must outlive the rule set.
+ */
+class RuleSet {
+    const PicoMath &   context;
+    CompiledExpression program{};
+    error_t            lastError{};
+    bool               compacted{true}; // No rule was added since the last compaction
+
+  public:
+    explicit RuleSet(const PicoMath &picomathContext) : context(picomathContext) {
+    }
+
+    /**
+     * @brief Compiles a formula and adds it to the set
+     *
+     * @param formula Expression of the rule
+     * @return std::optional<size_t> Index of the rule in the outputs, or nothing if the formula is
+     * invalid. Invalid formulas are not added, getLastError describes why
+     */
+    auto addRule(const char *formula) -> std::optional<size_t> {
+        size_t   nodeCount    = program.nodes.size();
+        size_t   operandCount = program.operands.size();
+        size_t   requested    = program.requested;
+        Compiler compiler(context, program, formula);
+        uint32_t output = compiler.compileSingle();
+        if (output == CompiledExpression::invalidNode) {
+            program.rollback(nodeCount, operandCount);
+            program.requested = requested;
+            lastError         = std::move(compiler.error);
+            return std::nullopt;
+        }
+        program.outputs.push_back(output);
+        compacted = false;
+        return program.outputs.size() - 1;
+    }
+
+    /**
+     * @brief Describes why the last invalid formula was rejected by addRule
+     */
+    [[nodiscard]] auto getLastError() const -> const char * {
+        return lastError.c_str();
+    }
+
+    [[nodiscard]] auto size() const -> size_t {
+        return program.outputs.size();
+    }
+
+    /**
+     * @brief Evaluates every rule with the current values of the variables
+     *
+     * @param out One value per rule, resized to the number of rules
+     * @param errors Bitmap with one bit per rule, set when a rule depends on a failing function call
+     * @return true Every rule succeeded
+     */
+    auto evaluate(std::vector<number_t> &out, std::vector<uint64_t> &errors) -> bool {
+        if (!compacted) {
+            // Constants consumed by folding are not computed, but they would take batch columns
+            program.compact();
+            compacted = true;
+        }
+        out.resize(program.outputs.size());
+        errors.resize((program.outputs.size() + 63) / 64);
+        program.evalList(out.data(), out.size(), errors.data());
+        for (uint64_t word : errors) {
+            if (word != 0) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    [[nodiscard]] auto getStats() const -> RuleSetStats {
+        RuleSetStats stats;
+        stats.rules     = program.outputs.size();
+        stats.requested = program.requested;
+        stats.nodes     = program.nodes.size();
+        for (const auto &node : program.nodes) {
+            if (node.op != CompiledExpression::Op::Constant) {
+                stats.evaluated++;
+            }
+        }
+        return stats;
+    }
+};
+
+template <bool budgeted>
+inline auto BasicExpression<budgeted>::parseReduction(std::string_view identifier, Result &outResult) -> bool {
+    CompiledExpression::Reduction kind{};
+    if (!CompiledExpression::findReduction(identifier, kind)) {
+        return false;
+    }
+    // The call is compiled once, reading an array makes it a reduction, then it runs as compiled
+    CompiledExpression call;
+    Compiler           compiler(context, call, originalStr);
+    compiler.str  = str;
+    uint32_t root = compiler.compileFunction(identifier);
+    str           = compiler.str;
+    if (PM_UNLIKELY(root == CompiledExpression::invalidNode)) {
+        outResult = {std::move(compiler.error)};
+        return true;
+    }
+    if constexpr (budgeted) {
+        // Operands of the arguments count once, like in CompiledExpression::getCost, and the
+        // element-wise programs once per element. Huge arrays are rejected before running anything
+        constexpr size_t max     = std::numeric_limits<size_t>::max();
+        size_t           charged = call.cost.operations + call.reductionOperations();
+        operations               = charged > max - operations ? max : operations + charged;
+        if (PM_UNLIKELY(depth + call.cost.depth > budget.maxDepth)) {
+            outResult = generateBudgetError("Nesting too deep");
+            return true;
+        }
+        const char *exceeded = operations > checkpoint ? checkBudget() : nullptr;
+        if (PM_UNLIKELY(exceeded != nullptr)) {
+            outResult = generateBudgetError(exceeded);
+            return true;
+        }
+        if (hasDeadline) {
+            call.limitReductions(budget.deadline);
+        }
+    }
+    call.outputs.push_back(root);
+    Result ret = call.eval();
+    if (PM_UNLIKELY(ret.isBudgetExceeded())) {
+        outResult = generateBudgetError(ret.getError());
+    } else if (PM_UNLIKELY(ret.isOk() && isPastDeadline())) {
+        outResult = generateBudgetError("Deadline exceeded");
+    } else {
+        outResult = std::move(ret);
+    }
+    return true;
+}
+
 inline auto PicoMath::evalExpression(const char *expression) -> Result {
     Expression exp(*this, expression);
     return exp.evalSingle();
 }
 
+inline auto PicoMath::evalExpression(const char *expression, const Budget &budget) -> Result {
+    // Looks for the end of the string without reading past the limit
+    if (budget.maxLength != std::numeric_limits<size_t>::max() &&
+        std::memchr(expression, 0, budget.maxLength + 1) == nullptr) {
+        return {"Expression too long", ErrorKind::BudgetExceeded};
+    }
+    BasicExpression<true> exp(*this, expression, budget);
+    return exp.evalSingle();
+}
+
 inline auto PicoMath::evalMultiExpression(const char *expression) -> Expression {
     return {*this, expression};
 }
 
+inline auto PicoMath::evalList(const char *expression, number_t *out, size_t capacity, uint64_t *errors) -> size_t {
+    Expression exp(*this, expression);
+    return exp.evalList(out, capacity, errors);
+}
+
+inline auto PicoMath::compileExpression(const char *expression) -> CompiledExpression {
+    CompiledExpression program;
+    Compiler           compiler(*this, program, expression);
+    uint32_t           output = compiler.compileSingle();
+    if (output == CompiledExpression::invalidNode) {
+        program.error = std::make_unique<error_t>(std::move(compiler.error));
+        return program;
+    }
+    program.outputs.push_back(output);
+    program.compact();
+    // The interning table is only needed while compiling
+    program.interned.clear();
+    return program;
+}
+
+inline auto PicoMath::compileList(const char *expression) -> CompiledExpression {
+    CompiledExpression program;
+    Compiler           compiler(*this, program, expression);
+    compiler.compileList();
+    program.compact();
+    program.interned.clear();
+    return program;
+}
+
 } // namespace picomath
 #endif
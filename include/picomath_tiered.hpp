@@ -0,0 +1,300 @@
+/**
+ * @file picomath_tiered.hpp
+ * @brief Adaptive tiered evaluation for PicoMath. BSD 3-Clause License
+ *
+ * Formulas start in the direct evaluator of PicoMath, which needs no preparation. Formulas that are
+ * evaluated often are compiled, and the hottest ones are specialized, in a helper thread. The new
+ * program is swapped in atomically, so the evaluating thread never waits for a compilation.
+ */
+#ifndef PICOMATH_TIERED_HPP
+#define PICOMATH_TIERED_HPP
+
+#include "picomath.hpp"
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+
+namespace picomath {
+
+enum class Tier
+{
+    Interpreted = 0, // Direct evaluation while parsing
+    Compiled    = 1, // CompiledExpression
+    Specialized = 2  // CompiledExpression::specialize
+};
+
+struct TierOptions {
+    size_t compileThreshold{16};      // Evaluations before a formula is compiled
+    size_t specializeThreshold{1024}; // Evaluations before a formula is specialized
+    size_t maxFormulas{1024};         // Formulas tracked at once, the least recently used one is evicted
+};
+
+/**
+ * @brief Counters of a TieredEvaluator. Times are measured around each evaluation
+ */
+struct TierStats {
+    std::array<size_t, 3>                   evaluations{}; // Evaluations at each tier
+    std::array<std::chrono::nanoseconds, 3> time{};        // Time spent evaluating at each tier
+    size_t                                  compiled{0};    // Promotions to Tier::Compiled
+    size_t                                  specialized{0}; // Promotions to Tier::Specialized
+    size_t                                  failed{0};      // Invalid formulas, kept in Tier::Interpreted
+    size_t                                  evicted{0};     // Formulas dropped to respect TierOptions::maxFormulas
+};
+
+/**
+ * @brief Evaluates formulas through the fastest tier available for each of them.
+ * Only one thread can evaluate at a time. The structure of the context (variables, units and
+ * functions) must not change while the evaluator exists, as the helper thread compiles against it.
+ * Values of variables and units can change freely.
+ * Compiling folds the calls of pure functions with constant arguments, so the helper thread calls
+ * pure functions while the evaluating thread may be calling them too: pure functions must be safe
+ * to call from several threads at once. Result caches are not used when folding.
+ *
+ * A formula is only tracked from its second evaluation, so formulas evaluated once don't allocate.
+ * At most TierOptions::maxFormulas formulas are tracked; the least recently evaluated one without a
+ * pending promotion is evicted to make room, and starts again in Tier::Interpreted if it comes back.
+ */
+class TieredEvaluator {
+    struct Program {
+        CompiledExpression expression;
+        Tier               tier;
+    };
+
+    struct Formula {
+        std::string                    source;
+        size_t                         evaluations{0};
+        std::atomic<Program *>         active{nullptr}; // Program of the current tier
+        std::atomic<bool>              failed{false};
+        bool                           scheduled{false}; // A promotion is queued or running, guarded by the mutex
+        std::unique_ptr<Program>       compiled{};
+        std::unique_ptr<Program>       specialized{};
+        std::list<Formula *>::iterator use{}; // Position in the recency list
+
+        explicit Formula(std::string_view text) : source(text) {
+        }
+    };
+
+    static constexpr size_t sightingSlots = 4096;
+
+    struct Job {
+        Formula *formula;
+        Tier     target;
+    };
+
+    PicoMath &                                                   context;
+    TierOptions                                                  options;
+    TierStats                                                    stats{};
+    std::map<std::string, std::unique_ptr<Formula>, std::less<>> formulas{};
+    std::list<Formula *>                                         recency{}; // Most recently evaluated first
+    // Evaluations of formulas that are not tracked yet, by hash of the source
+    std::array<uint8_t, sightingSlots> sightings{};
+
+    std::mutex              mutex{};
+    std::condition_variable wakeup{};
+    std::condition_variable idle{};
+    std::deque<Job>         jobs{};
+    size_t                  pending{0}; // Scheduled promotions that haven't finished
+    bool                    stopping{false};
+    std::thread             helper{};
+
+    auto promote(const Job &job) -> void {
+        Formula &formula = *job.formula;
+        auto     program = std::make_unique<Program>(
+            Program{context.compileExpression(formula.source.c_str()), job.target});
+        if (program->expression.isError()) {
+            formula.failed.store(true, std::memory_order_release);
+            return;
+        }
+        if (job.target == Tier::Specialized) {
+            program->expression.specialize();
+        }
+        // The previous program stays alive, the evaluating thread may still be using it
+        auto &slot = job.target == Tier::Specialized ? formula.specialized : formula.compiled;
+        slot       = std::move(program);
+        formula.active.store(slot.get(), std::memory_order_release);
+    }
+
+    static auto tierOf(const Program *program) -> Tier {
+        return program == nullptr ? Tier::Interpreted : program->tier;
+    }
+
+    auto run() -> void {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            wakeup.wait(lock, [this] { return stopping || !jobs.empty(); });
+            if (stopping) {
+                return;
+            }
+            Job job = jobs.front();
+            jobs.pop_front();
+            lock.unlock();
+            promote(job);
+            lock.lock();
+            job.formula->scheduled = false;
+            pending--;
+            if (pending == 0) {
+                idle.notify_all();
+            }
+        }
+    }
+
+    auto schedule(Formula *formula, Tier target) -> void {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            jobs.push_back({formula, target});
+            formula->scheduled = true;
+            pending++;
+        }
+        wakeup.notify_one();
+    }
+
+    /**
+     * @brief Drops the least recently evaluated formula that has no pending promotion, keeping its
+     * promotions in the counters
+     *
+     * @return false Every formula has a pending promotion, nothing was dropped
+     */
+    auto evict() -> bool {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (auto it = recency.rbegin(); it != recency.rend(); ++it) {
+            Formula &victim = **it;
+            if (victim.scheduled) {
+                continue;
+            }
+            Tier tier = tierOf(victim.active.load(std::memory_order_acquire));
+            stats.compiled += tier >= Tier::Compiled ? 1 : 0;
+            stats.specialized += tier == Tier::Specialized ? 1 : 0;
+            stats.failed += victim.failed.load(std::memory_order_acquire) ? 1 : 0;
+            stats.evicted++;
+            recency.erase(victim.use);
+            formulas.erase(formulas.find(victim.source));
+            return true;
+        }
+        return false;
+    }
+
+    /**
+     * @brief Finds the formula of an expression, tracking it from its second evaluation
+     *
+     * @return Formula* Tracked formula, or null if the expression was not seen before or if every
+     * tracked formula has a pending promotion and none can make room for it
+     */
+    auto track(const char *expression) -> Formula * {
+        std::string_view source(expression);
+        auto             found = formulas.find(source);
+        if (PM_LIKELY(found != formulas.end())) {
+            Formula &formula = *found->second;
+            recency.splice(recency.begin(), recency, formula.use);
+            return &formula;
+        }
+        uint8_t &seen = sightings[std::hash<std::string_view>{}(source) % sightingSlots];
+        seen          = static_cast<uint8_t>(std::min(seen + 1, 255));
+        if (seen < 2 && options.compileThreshold > 1) {
+            return nullptr;
+        }
+        if (formulas.size() >= std::max<size_t>(options.maxFormulas, 1) && !evict()) {
+            return nullptr;
+        }
+        auto     formula = std::make_unique<Formula>(source);
+        Formula *tracked = formula.get();
+        // Includes the evaluation that wasn't tracked
+        tracked->evaluations = options.compileThreshold > 1 ? 1 : 0;
+        formulas.emplace(source, std::move(formula));
+        recency.push_front(tracked);
+        tracked->use = recency.begin();
+        return tracked;
+    }
+
+  public:
+    explicit TieredEvaluator(PicoMath &picomathContext, TierOptions tierOptions = {})
+        : context(picomathContext), options(tierOptions) {
+        helper = std::thread([this] { run(); });
+    }
+
+    TieredEvaluator(const TieredEvaluator &) = delete;
+    auto operator=(const TieredEvaluator &) -> TieredEvaluator & = delete;
+
+    ~TieredEvaluator() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wakeup.notify_one();
+        helper.join();
+    }
+
+    /**
+     * @brief Evaluates the expression with the fastest tier available for it
+     *
+     * @param expression Expression to evaluate
+     * @return Result Result containing the result value or an error
+     */
+    auto evalExpression(const char *expression) -> Result {
+        auto start = std::chrono::steady_clock::now();
+
+        Formula *formula = track(expression);
+        Program *program = nullptr;
+        if (formula != nullptr) {
+            size_t count = ++formula->evaluations;
+            program      = formula->active.load(std::memory_order_acquire);
+            Tier tier    = tierOf(program);
+            // Promotions are requested once, when the count crosses each threshold. Formulas that
+            // failed to compile stay interpreted
+            bool failed = formula->failed.load(std::memory_order_acquire);
+            if (count == options.compileThreshold && tier == Tier::Interpreted && !failed) {
+                schedule(formula, Tier::Compiled);
+            } else if (count == options.specializeThreshold && tier != Tier::Specialized && !failed) {
+                schedule(formula, Tier::Specialized);
+            }
+        }
+        Result result = program == nullptr ? context.evalExpression(expression) : program->expression.eval();
+
+        // The tier is the one of the program that was evaluated
+        auto index = static_cast<size_t>(tierOf(program));
+        stats.evaluations[index]++;
+        stats.time[index] += std::chrono::steady_clock::now() - start;
+        return result;
+    }
+
+    /**
+     * @brief Current tier of a formula, Tier::Interpreted if it was never evaluated
+     */
+    [[nodiscard]] auto getTier(std::string_view expression) const -> Tier {
+        auto found = formulas.find(expression);
+        return found == formulas.end() ? Tier::Interpreted
+                                       : tierOf(found->second->active.load(std::memory_order_acquire));
+    }
+
+    /**
+     * @brief Waits until every requested promotion has finished. Useful for tests and warm-up
+     */
+    auto wait() -> void {
+        std::unique_lock<std::mutex> lock(mutex);
+        idle.wait(lock, [this] { return pending == 0; });
+    }
+
+    [[nodiscard]] auto getStats() const -> TierStats {
+        TierStats current = stats;
+        for (const auto &formula : formulas) {
+            Tier tier = tierOf(formula.second->active.load(std::memory_order_acquire));
+            current.compiled += tier >= Tier::Compiled ? 1 : 0;
+            current.specialized += tier == Tier::Specialized ? 1 : 0;
+            current.failed += formula.second->failed.load(std::memory_order_acquire) ? 1 : 0;
+        }
+        return current;
+    }
+};
+
+} // namespace picomath
+#endif
@@ -1,4 +1,9 @@
+#include <chrono>
+#include <cstring>
 #include <picomath.hpp>
+#include <picomath_tiered.hpp>
+#include <thread>
+#include "../tools/service.hpp"
 #define CATCH_CONFIG_MAIN
 #include <catch.hpp>
 
@@ -8,6 +13,10 @@ auto AreSame(number_t a, number_t b) -> bool {
     return fabs(a - b) < FLT_EPSILON;
 }
 
+auto AreIdentical(number_t a, number_t b) -> bool {
+    return std::memcmp(&a, &b, sizeof(number_t)) == 0;
+}
+
 TEST_CASE("Simple expressions") {
     PicoMath ctx;
     REQUIRE(AreSame(ctx.evalExpression("2 + 2").getResult(), 4.0));
@@ -129,3 +138,864 @@ TEST_CASE("Variables") {
     REQUIRE(AreSame(ctx.evalExpression("max(x,y) * 2").getResult(), 4.0));
     REQUIRE(AreSame(ctx.evalExpression("min(x,y) * 2").getResult(), 0.0));
 }
+
+TEST_CASE("Compiled expressions") {
+    PicoMath ctx;
+    auto &   x = ctx.addVariable("x");
+    auto &   y = ctx.addVariable("y");
+    ctx.addUnit("km") = 1000.0;
+
+    auto expression = ctx.compileExpression("sqrt(x*x + y*y) + 1km - -(2 + 2)");
+    REQUIRE(expression.isOk());
+    x = 3;
+    y = 4;
+    REQUIRE(AreSame(expression.eval().getResult(), 1009.0));
+    x = 6;
+    y = 8;
+    REQUIRE(AreSame(expression.eval().getResult(), 1014.0));
+
+    // Identical subexpressions share nodes and constants are folded
+    auto shared = ctx.compileExpression("(x*y + 1) * (y*x + 1) * (cos(0) + 1 - 1)");
+    // x, y, x*y, 1, x*y + 1, the product and the product times the folded constant
+    REQUIRE(shared.size() == 7);
+    REQUIRE(AreSame(shared.eval().getResult(), 49.0 * 49.0));
+
+    REQUIRE(ctx.compileExpression("").isError());
+    REQUIRE(ctx.compileExpression("3 *").isError());
+    REQUIRE(ctx.compileExpression("notfound").isError());
+    REQUIRE(ctx.compileExpression("cos(1, 2)").isError());
+    REQUIRE(ctx.compileExpression("2px").isError());
+    REQUIRE(ctx.compileExpression("(2+2) 3").isError());
+    REQUIRE(ctx.compileExpression("(2+2) 3").eval().isError());
+    REQUIRE(ctx.compileExpression("pow(x)").eval().isError());
+
+    // Errors of calls point to the call, as in direct evaluation
+    ctx.addFunction("fail", [](size_t /*argc*/, const argument_list_t & /*args*/) -> Result { return {"Failed"}; });
+    REQUIRE(std::string(ctx.compileExpression("x + fail(y)").eval().getError()) ==
+            ctx.evalExpression("x + fail(y)").getError());
+    REQUIRE(std::string(ctx.compileExpression("x + fail(y)").eval().getError()) == "In character 10: Failed `fail`");
+}
+
+static int callCount = 0; // NOLINT
+
+TEST_CASE("Pure functions") {
+    PicoMath ctx;
+    auto &   x = ctx.addVariable("x");
+    ctx.addFunction(
+        "table",
+        [](number_t input) -> number_t {
+            callCount++;
+            return input * 2;
+        },
+        Purity::Pure);
+    ctx.addFunction("noisy", [](number_t input) -> number_t {
+        callCount++;
+        return input * 2;
+    });
+
+    x         = 2;
+    callCount = 0;
+    auto pure = ctx.compileExpression("table(x) + table(x) * table(x + 0)");
+    REQUIRE(AreSame(pure.eval().getResult(), 4.0 + 4.0 * 4.0));
+    REQUIRE(callCount == 2);
+
+    callCount   = 0;
+    auto impure = ctx.compileExpression("noisy(x) + noisy(x)");
+    REQUIRE(AreSame(impure.eval().getResult(), 8.0));
+    REQUIRE(callCount == 2);
+
+    // Calls with constant arguments are evaluated when compiling
+    callCount     = 0;
+    auto constant = ctx.compileExpression("table(21)");
+    REQUIRE(callCount == 1);
+    REQUIRE(AreSame(constant.eval().getResult(), 42.0));
+    REQUIRE(callCount == 1);
+
+    REQUIRE_FALSE(ctx.setFunctionCache("noisy", 16));
+    REQUIRE_FALSE(ctx.setFunctionCache("notfound", 16));
+    REQUIRE(ctx.setFunctionCache("table", 16));
+    callCount = 0;
+    for (int i = 0; i < 10; i++) {
+        x = static_cast<number_t>(i % 2);
+        REQUIRE(AreSame(ctx.evalExpression("table(x)").getResult(), x * 2));
+    }
+    REQUIRE(callCount == 2);
+    auto stats = ctx.getFunctionCacheStats("table");
+    REQUIRE(stats.capacity == 16);
+    REQUIRE(stats.hits == 8);
+    REQUIRE(stats.misses == 2);
+    REQUIRE(AreSame(stats.hitRate(), 0.8));
+    REQUIRE(ctx.getFunctionCacheStats("noisy").capacity == 0);
+
+    // Copies have their own variables and an empty cache
+    PicoMath copy = ctx;
+    copy.addVariable("x") = 5;
+    REQUIRE(AreSame(copy.evalExpression("table(x)").getResult(), 10.0));
+    REQUIRE(copy.getFunctionCacheStats("table").capacity == 16);
+    REQUIRE(copy.getFunctionCacheStats("table").misses == 1);
+    REQUIRE(ctx.getFunctionCacheStats("table").misses == 2);
+    REQUIRE(AreSame(x, 1.0));
+}
+
+TEST_CASE("Batch evaluation") {
+    PicoMath ctx;
+    auto &   x = ctx.addVariable("x");
+    auto &   y = ctx.addVariable("y");
+    y          = 10;
+
+    // Bulk function: one call receives the arguments of many rows
+    static size_t bulkCalls = 0;
+    ctx.addFunction(
+        "lookup",
+        [](size_t argc, const number_t *const *columns, size_t rows, number_t *out) -> Result {
+            if (argc != 1) {
+                return {"One argument required"};
+            }
+            bulkCalls++;
+            for (size_t row = 0; row < rows; row++) {
+                out[row] = columns[0][row] * 3;
+            }
+            return {};
+        },
+        Purity::Pure);
+    ctx.addFunction("fail", [](size_t /*argc*/, const argument_list_t & /*args*/) -> Result { return {"Failed"}; });
+
+    // Bulk functions work in scalar evaluations too
+    x = 2;
+    REQUIRE(AreSame(ctx.evalExpression("lookup(x) + 1").getResult(), 7.0));
+    REQUIRE(ctx.evalExpression("lookup(1, 2)").isError());
+
+    const size_t          rows = 1000;
+    std::vector<number_t> xs(rows);
+    std::vector<number_t> out(rows);
+    for (size_t i = 0; i < rows; i++) {
+        xs[i] = static_cast<number_t>(i);
+    }
+
+    auto expression = ctx.compileExpression("lookup(x) + sqrt(x * x) - max(x, 1) * y + 2");
+    REQUIRE(expression.isOk());
+    bulkCalls = 0;
+    REQUIRE(expression.evalBatch(rows, {{&x, xs.data()}}, out.data()).isOk());
+    REQUIRE(bulkCalls == (rows + PM_BATCH_SIZE - 1) / PM_BATCH_SIZE);
+    for (size_t i = 0; i < rows; i++) {
+        number_t v = xs[i];
+        REQUIRE(AreSame(out[i], v * 3 + v - std::max<number_t>(v, 1) * 10 + 2));
+    }
+
+    // Batch and scalar evaluations give the same results
+    x = 7;
+    REQUIRE(AreSame(expression.eval().getResult(), 21.0 + 7.0 - 70.0 + 2.0));
+
+    REQUIRE(ctx.compileExpression("fail(x) + 1").evalBatch(rows, {{&x, xs.data()}}, out.data()).isError());
+
+    // Batch and scalar errors read the same
+    auto   failing = ctx.compileExpression("x + fail(x)");
+    Result batch   = failing.evalBatch(rows, {{&x, xs.data()}}, out.data());
+    REQUIRE(std::string(batch.getError()) == "In character 10: Failed `fail`");
+    REQUIRE(std::string(batch.getError()) == failing.eval().getError());
+}
+
+TEST_CASE("Lists") {
+    PicoMath ctx;
+    auto &   x = ctx.addVariable("x");
+    ctx.addFunction("fail", [](size_t /*argc*/, const argument_list_t & /*args*/) -> Result { return {"Failed"}; });
+    x = 3;
+
+    std::array<number_t, 8> out{};
+    std::array<uint64_t, 1> errors{~uint64_t{0}};
+    const char *            list = "-2, 2 * x, max(1, x, 2), notfound, (1, 2), 5 6, pi";
+    REQUIRE(ctx.evalList(list, out.data(), out.size(), errors.data()) == 7);
+    REQUIRE(AreSame(out[0], -2));
+    REQUIRE(AreSame(out[1], 6));
+    REQUIRE(AreSame(out[2], 3));
+    REQUIRE(AreSame(out[6], M_PI));
+    // Only the bits of the evaluated items are written
+    REQUIRE(errors[0] == (~uint64_t{0} << 7U | 0b0111000));
+
+    // Items beyond the capacity are not evaluated
+    REQUIRE(ctx.evalList(list, out.data(), 2, errors.data()) == 2);
+    REQUIRE(ctx.evalList("", out.data(), out.size(), errors.data()) == 0);
+
+    auto compiled = ctx.compileList(list);
+    REQUIRE(compiled.isOk());
+    REQUIRE(compiled.outputCount() == 7);
+    errors[0] = 0;
+    REQUIRE(compiled.evalList(out.data(), out.size(), errors.data()) == 7);
+    REQUIRE(AreSame(out[1], 6));
+    REQUIRE(errors[0] == 0b0111000);
+    x = 5;
+    REQUIRE(compiled.evalList(out.data(), out.size(), errors.data()) == 7);
+    REQUIRE(AreSame(out[1], 10));
+    REQUIRE(AreSame(out[2], 5));
+
+    // Runtime errors only affect the items that depend on them
+    auto failing = ctx.compileList("x + 1, fail(x) * 2, x * 2");
+    errors[0]    = 0;
+    REQUIRE(failing.evalList(out.data(), out.size(), errors.data()) == 3);
+    REQUIRE(AreSame(out[0], 6));
+    REQUIRE(AreSame(out[2], 10));
+    REQUIRE(errors[0] == 0b010);
+    // Unary nodes only inherit the errors of their operand, not of the first node
+    auto negated = ctx.compileList("fail(), -x");
+    REQUIRE(negated.evalList(out.data(), out.size(), errors.data()) == 2);
+    REQUIRE(AreSame(out[1], -5));
+    REQUIRE(errors[0] == 0b01);
+
+    REQUIRE(ctx.compileList("notfound, 1").eval().isError());
+}
+
+TEST_CASE("Rule sets") {
+    PicoMath ctx;
+    auto &   x = ctx.addVariable("x");
+    auto &   y = ctx.addVariable("y");
+    ctx.addFunction("fail", [](size_t /*argc*/, const argument_list_t & /*args*/) -> Result { return {"Failed"}; });
+
+    RuleSet rules(ctx);
+    REQUIRE(rules.addRule("sqrt(x*x + y*y)") == 0U);
+    REQUIRE(rules.addRule("sqrt(y*y + x*x) * 2") == 1U);
+    REQUIRE_FALSE(rules.addRule("sqrt(x*x + y*y) + notfound").has_value());
+    REQUIRE(std::string(rules.getLastError()) == "In character 25: Unknown variable `notfound`");
+    REQUIRE(rules.addRule("x*x - y*y") == 2U);
+    REQUIRE(rules.size() == 3);
+
+    // x, y, x*x, y*y, the sum, sqrt, 2, the product and the difference
+    auto stats = rules.getStats();
+    REQUIRE(stats.rules == 3);
+    REQUIRE(stats.nodes == 9);
+    REQUIRE(stats.evaluated == 8);
+    REQUIRE(stats.requested == 25);
+    REQUIRE(stats.savedRatio() > 0.6);
+
+    std::vector<number_t> out;
+    std::vector<uint64_t> errors;
+    x = 3;
+    y = 4;
+    REQUIRE(rules.evaluate(out, errors));
+    REQUIRE(out.size() == 3);
+    REQUIRE(AreSame(out[0], 5));
+    REQUIRE(AreSame(out[1], 10));
+    REQUIRE(AreSame(out[2], -7));
+    x = 6;
+    y = 8;
+    REQUIRE(rules.evaluate(out, errors));
+    REQUIRE(AreSame(out[1], 20));
+
+    REQUIRE(rules.addRule("fail(x)") == 3U);
+    REQUIRE_FALSE(rules.evaluate(out, errors));
+    REQUIRE(errors[0] == 0b1000);
+    REQUIRE(AreSame(out[2], -28));
+
+    // Constants consumed by folding are dropped before evaluating, and rules can still be added
+    REQUIRE(rules.addRule("x * (3 * 5)") == 4U);
+    REQUIRE_FALSE(rules.evaluate(out, errors));
+    REQUIRE(rules.getStats().nodes == 12);
+    REQUIRE(rules.addRule("(x*x + y*y) * 15") == 5U);
+    REQUIRE(rules.getStats().nodes == 13);
+    REQUIRE_FALSE(rules.evaluate(out, errors));
+    REQUIRE(AreSame(out[4], 90));
+    REQUIRE(AreSame(out[5], 1500));
+
+    // Rejected rules drop their reductions
+    std::vector<number_t> values{1, 2, 3};
+    ctx.addArray("a") = {values.data(), values.size()};
+    REQUIRE_FALSE(rules.addRule("sum(a * x) + notfound").has_value());
+    REQUIRE(rules.addRule("max(a) * 2 + sum(a)") == 6U);
+    REQUIRE_FALSE(rules.evaluate(out, errors));
+    REQUIRE(AreSame(out[6], 12));
+}
+
+TEST_CASE("Specialized expressions") {
+    PicoMath ctx;
+    auto &   x = ctx.addVariable("x");
+    auto &   y = ctx.addVariable("y");
+    ctx.addFunction("fail", [](size_t /*argc*/, const argument_list_t & /*args*/) -> Result { return {"Failed"}; });
+
+    const char *source     = "x * y + sqrt(x) + (x * 2 + 1) * (y * x + 3) + pow(x, y)";
+    auto        compiled   = ctx.compileExpression(source);
+    auto        specialize = ctx.compileExpression(source);
+    specialize.specialize();
+    REQUIRE(specialize.size() < compiled.size());
+    for (int i = 1; i < 10; i++) {
+        x = static_cast<number_t>(i);
+        y = static_cast<number_t>(10 - i);
+        // Specializing keeps the rounding of every operation
+        REQUIRE(AreIdentical(specialize.eval().getResult(), compiled.eval().getResult()));
+        REQUIRE(AreIdentical(specialize.eval().getResult(), ctx.evalExpression(source).getResult()));
+    }
+
+    std::vector<number_t> xs{1, 2, 3, 4};
+    std::vector<number_t> out(xs.size());
+    REQUIRE(specialize.evalBatch(xs.size(), {{&x, xs.data()}}, out.data()).isOk());
+    x = 3;
+    REQUIRE(out[2] == Approx(specialize.eval().getResult()));
+
+    auto failing = ctx.compileExpression("fail(x) + x * y");
+    failing.specialize();
+    REQUIRE(failing.eval().isError());
+}
+
+TEST_CASE("Tiered evaluation") {
+    PicoMath    ctx;
+    auto &      x = ctx.addVariable("x");
+    TierOptions options;
+    options.compileThreshold    = 2;
+    options.specializeThreshold = 4;
+    TieredEvaluator tiered(ctx, options);
+
+    const char *source = "x * x + sqrt(x) * 2";
+    REQUIRE(tiered.getTier(source) == Tier::Interpreted);
+    for (int i = 0; i < 8; i++) {
+        x = static_cast<number_t>(i);
+        REQUIRE(AreIdentical(tiered.evalExpression(source).getResult(), ctx.evalExpression(source).getResult()));
+        // Promotions happen in the background, wait for them to make the test deterministic
+        tiered.wait();
+        if (i == 1) {
+            REQUIRE(tiered.getTier(source) == Tier::Compiled);
+        }
+    }
+    REQUIRE(tiered.getTier(source) == Tier::Specialized);
+
+    REQUIRE(tiered.evalExpression("notfound").isError());
+    REQUIRE(tiered.evalExpression("notfound").isError());
+    tiered.wait();
+    REQUIRE(tiered.evalExpression("notfound").isError());
+
+    auto stats = tiered.getStats();
+    REQUIRE(stats.evaluations[0] == 2 + 3);
+    REQUIRE(stats.evaluations[1] == 2);
+    REQUIRE(stats.evaluations[2] == 4);
+    REQUIRE(stats.compiled == 1);
+    REQUIRE(stats.specialized == 1);
+    REQUIRE(stats.failed == 1);
+
+    // The least recently evaluated formula is evicted, keeping its promotions in the counters
+    options.compileThreshold = 1;
+    options.maxFormulas      = 2;
+    TieredEvaluator bounded(ctx, options);
+    for (const char *formula : {"x + 1", "x + 2", "x + 1", "x + 3"}) {
+        REQUIRE(bounded.evalExpression(formula).isOk());
+        bounded.wait();
+    }
+    REQUIRE(bounded.getTier("x + 1") == Tier::Compiled);
+    REQUIRE(bounded.getTier("x + 2") == Tier::Interpreted);
+    REQUIRE(bounded.getStats().evicted == 1);
+    REQUIRE(bounded.getStats().compiled == 3);
+}
+
+TEST_CASE("Tiered promotions") {
+    // The helper thread calls pure functions when it folds them: the probe counts compilations,
+    // and holds them while `hold` is set
+    static std::thread::id   evaluating;
+    static std::atomic<int>  compilations{0};
+    static std::atomic<bool> hold{false};
+    evaluating = std::this_thread::get_id();
+    PicoMath ctx;
+    auto &   x = ctx.addVariable("x");
+    ctx.addFunction(
+        "probe",
+        [](number_t v) -> number_t {
+            if (std::this_thread::get_id() != evaluating) {
+                compilations++;
+                while (hold.load()) {
+                    std::this_thread::yield();
+                }
+            }
+            return v;
+        },
+        Purity::Pure);
+    x = 1;
+
+    // Formulas that failed to compile are not compiled again to specialize them
+    TierOptions options;
+    options.compileThreshold    = 2;
+    options.specializeThreshold = 4;
+    {
+        TieredEvaluator tiered(ctx, options);
+        for (int i = 0; i < 6; i++) {
+            REQUIRE(tiered.evalExpression("probe(1) + notfound").isError());
+            tiered.wait();
+        }
+        REQUIRE(compilations == 1);
+        REQUIRE(tiered.getStats().failed == 1);
+    }
+
+    // Formulas with a pending promotion are not evicted, new ones are not tracked instead
+    options.compileThreshold = 1;
+    options.maxFormulas      = 1;
+    TieredEvaluator bounded(ctx, options);
+    hold = true;
+    REQUIRE(bounded.evalExpression("probe(2) + x").getResult() == Approx(3));
+    REQUIRE(bounded.evalExpression("x + 2").getResult() == Approx(3));
+    hold = false;
+    bounded.wait();
+    REQUIRE(bounded.getTier("probe(2) + x") == Tier::Compiled);
+    REQUIRE(bounded.getTier("x + 2") == Tier::Interpreted);
+    REQUIRE(bounded.getStats().evicted == 0);
+}
+
+TEST_CASE("Forked contexts") {
+    PicoMath base;
+    auto &   x         = base.addVariable("x");
+    x                  = 2;
+    base.addUnit("px") = 10;
+    base.addFunction("twice", [](number_t v) -> number_t { return v * 2; }, Purity::Pure);
+
+    PicoMath child = base.fork();
+    REQUIRE(child.evalExpression("twice(x) + 1px + pi").getResult() == Approx(4 + 10 + M_PI));
+    REQUIRE(child.compileExpression("twice(x) * 1px").eval().getResult() == Approx(40));
+
+    // Additions are private to each context
+    child.addVariable("y") = 5;
+    REQUIRE(child.evalExpression("x + y").getResult() == Approx(7));
+    REQUIRE(base.evalExpression("x + y").isError());
+    base.addFunction("half", [](number_t v) -> number_t { return v / 2; });
+    REQUIRE(child.evalExpression("half(4)").isError());
+    REQUIRE(base.evalExpression("half(4)").getResult() == Approx(2));
+
+    // Values of the frozen layer are shared until a context shadows them
+    x = 3;
+    REQUIRE(child.evalExpression("x").getResult() == Approx(3));
+    child.addVariable("x") = 7;
+    REQUIRE(child.evalExpression("x").getResult() == Approx(7));
+    REQUIRE(base.evalExpression("x").getResult() == Approx(3));
+
+    // Built-ins can be overridden per context
+    child.addFunction("sqrt", [](number_t /*v*/) -> number_t { return 42; });
+    REQUIRE(child.evalExpression("sqrt(4)").getResult() == Approx(42));
+    REQUIRE(base.evalExpression("sqrt(4)").getResult() == Approx(2));
+    REQUIRE(PicoMath().evalExpression("sqrt(4)").getResult() == Approx(2));
+
+    // Caches of inherited functions are private
+    REQUIRE(child.setFunctionCache("twice", 16));
+    REQUIRE(child.evalExpression("twice(3) + twice(3)").getResult() == Approx(12));
+    REQUIRE(child.getFunctionCacheStats("twice").hits == 1);
+    REQUIRE(base.getFunctionCacheStats("twice").capacity == 0);
+
+    // Forking a context with a cached function gives each side its own cache
+    PicoMath grandchild = child.fork();
+    REQUIRE(grandchild.getFunctionCacheStats("twice").capacity == 16);
+    REQUIRE(grandchild.getFunctionCacheStats("twice").hits == 0);
+    REQUIRE(grandchild.evalExpression("twice(3) + twice(4)").getResult() == Approx(14));
+    REQUIRE(grandchild.getFunctionCacheStats("twice").misses == 2);
+    REQUIRE(child.getFunctionCacheStats("twice").hits == 1);
+    REQUIRE(child.evalExpression("twice(3)").getResult() == Approx(6));
+    REQUIRE(child.getFunctionCacheStats("twice").hits == 2);
+}
+
+TEST_CASE("Budgets") {
+    PicoMath ctx;
+    auto &   x = ctx.addVariable("x");
+    x          = 2;
+    ctx.addFunction("slow", [](number_t v) -> number_t {
+        std::this_thread::sleep_for(std::chrono::milliseconds(2));
+        return v;
+    });
+
+    const char *source = "(x + 1) * sqrt(x * -x + 10)";
+    auto        cost   = ctx.compileExpression(source).getCost();
+    REQUIRE(cost.operations == 8);
+    REQUIRE(cost.depth == 3);
+    REQUIRE(cost.calls == 1);
+
+    // Exactly at the limits
+    Budget budget;
+    budget.maxOperations = cost.operations;
+    budget.maxDepth      = cost.depth;
+    budget.maxLength     = std::strlen(source);
+    REQUIRE(ctx.evalExpression(source, budget).getResult() == Approx(3 * std::sqrt(6)));
+    REQUIRE(ctx.evalExpression(source, budget).getErrorKind() == ErrorKind::None);
+
+    budget.maxOperations = cost.operations - 1;
+    auto result          = ctx.evalExpression(source, budget);
+    REQUIRE(result.isError());
+    REQUIRE(result.isBudgetExceeded());
+    REQUIRE(result.getError() == std::string("In character 23: Operation budget exceeded"));
+
+    budget.maxOperations = cost.operations;
+    budget.maxDepth      = cost.depth - 1;
+    REQUIRE(ctx.evalExpression(source, budget).isBudgetExceeded());
+    budget.maxDepth = 100;
+    REQUIRE(ctx.evalExpression(std::string(200, '(').c_str(), budget).isBudgetExceeded());
+
+    budget.maxLength = std::strlen(source) - 1;
+    REQUIRE(ctx.evalExpression(source, budget).isBudgetExceeded());
+
+    // Errors that are not caused by the budget keep their kind
+    REQUIRE(ctx.evalExpression("unknown").getErrorKind() == ErrorKind::Invalid);
+    REQUIRE(ctx.evalExpression("unknown", Budget{}).getErrorKind() == ErrorKind::Invalid);
+    // Errors in the middle of the expression are reported, instead of the characters left after them
+    REQUIRE(std::string(ctx.evalExpression("2 * unknown + 1").getError()) ==
+            "In character 11: Unknown variable `unknown`");
+    REQUIRE(std::string(ctx.evalExpression("2 + 3 4").getError()) ==
+            "In character 5: Invalid characters after expression found: 4");
+
+    Budget deadline;
+    deadline.deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(5);
+    REQUIRE(ctx.evalExpression("slow(1) + slow(2) + slow(3) + slow(4) + slow(5)", deadline).isBudgetExceeded());
+    deadline.deadline = std::chrono::steady_clock::now() - std::chrono::milliseconds(1);
+    std::string sum   = "1";
+    for (int i = 0; i < PM_DEADLINE_INTERVAL; i++) {
+        sum += " + 1";
+    }
+    REQUIRE(ctx.evalExpression(sum.c_str(), deadline).isBudgetExceeded());
+    REQUIRE(ctx.evalExpression("1 + 1", deadline).isOk());
+}
+
+TEST_CASE("Arrays and reductions") {
+    PicoMath              ctx;
+    std::vector<number_t> values{3, -1, 4, 1, -5, 9, 2, 6, 5, 3, 5};
+    std::vector<number_t> weights(values.size(), 2);
+    auto &                a = ctx.addArray("a");
+    auto &                w = ctx.addArray("w");
+    auto &                x = ctx.addVariable("x");
+    a                       = {values.data(), values.size()};
+    w                       = {weights.data(), weights.size()};
+    x                       = 10;
+
+    number_t sum     = 0;
+    number_t squares = 0;
+    for (number_t v : values) {
+        sum += v;
+    }
+    number_t mean = sum / static_cast<number_t>(values.size());
+    for (number_t v : values) {
+        squares += (v - mean) * (v - mean);
+    }
+    number_t stddev = std::sqrt(squares / static_cast<number_t>(values.size()));
+
+    for (Summation mode : {Summation::Fast, Summation::Pairwise, Summation::Kahan}) {
+        ctx.setSummation(mode);
+        REQUIRE(ctx.evalExpression("sum(a)").getResult() == Approx(sum));
+        REQUIRE(ctx.evalExpression("mean(a)").getResult() == Approx(mean));
+        REQUIRE(ctx.evalExpression("dot(a, w)").getResult() == Approx(2 * sum));
+        REQUIRE(ctx.evalExpression("sum(a * w + x)").getResult() == Approx(2 * sum + 10 * 11));
+        REQUIRE(ctx.compileExpression("sum(a * w + x) / 2 + 1").eval().getResult() == Approx(sum + 55 + 1));
+    }
+    REQUIRE(ctx.evalExpression("min(a)").getResult() == Approx(-5));
+    REQUIRE(ctx.evalExpression("max(a * 2 - x)").getResult() == Approx(8));
+    REQUIRE(ctx.evalExpression("stddev(a)").getResult() == Approx(stddev));
+    REQUIRE(ctx.evalExpression("max(sqrt(a * a)) + min(x, 2)").getResult() == Approx(9 + 2));
+    REQUIRE(ctx.evalExpression("sum(a - mean(a))").getResult() == Approx(0).margin(1e-9));
+
+    // Compiled reductions read the current contents of the arrays
+    auto compiled = ctx.compileExpression("sum(a) + max(a)");
+    REQUIRE(compiled.eval().getResult() == Approx(sum + 9));
+    values[5] = 19;
+    REQUIRE(compiled.eval().getResult() == Approx(sum + 10 + 19));
+    compiled.specialize();
+    REQUIRE(compiled.eval().getResult() == Approx(sum + 10 + 19));
+
+    // Blocks of many elements
+    std::vector<number_t> big(10000);
+    for (size_t i = 0; i < big.size(); i++) {
+        big[i] = static_cast<number_t>(i % 100);
+    }
+    auto &b = ctx.addArray("b");
+    b       = {big.data(), big.size()};
+    REQUIRE(ctx.evalExpression("sum(b)").getResult() == Approx(495000));
+    REQUIRE(ctx.evalExpression("max(b) - min(b)").getResult() == Approx(99));
+    REQUIRE(ctx.evalExpression("stddev(b)").getResult() == Approx(std::sqrt((100.0 * 100.0 - 1) / 12)));
+
+    // Compensated sums keep small values added to a large one
+    std::vector<number_t> skewed(1001, 1e-16);
+    skewed[0] = 1;
+    b         = {skewed.data(), skewed.size()};
+    ctx.setSummation(Summation::Kahan);
+    REQUIRE(ctx.evalExpression("sum(b) - 1").getResult() == Approx(1e-13).margin(1e-15));
+    ctx.setSummation(Summation::Fast);
+
+    REQUIRE(ctx.evalExpression("a + 1").isError());
+    REQUIRE(ctx.evalExpression("sum(a + b)").isError());
+    REQUIRE(ctx.evalExpression("dot(a)").isError());
+    REQUIRE(ctx.evalExpression("sum(a, a)").isError());
+    REQUIRE(ctx.compileExpression("sqrt(a)").isError());
+    REQUIRE(std::string(ctx.evalExpression("sum(a + b)").getError()) ==
+            "In character 9: Arrays of different sizes in `sum`");
+    REQUIRE(std::string(ctx.compileExpression("sum(a + b)").eval().getError()) ==
+            "In character 9: Arrays of different sizes in `sum`");
+    ctx.addArray("empty");
+    REQUIRE(ctx.evalExpression("sum(empty)").getResult() == Approx(0));
+    REQUIRE(ctx.evalExpression("mean(empty)").isError());
+
+    // Reading an array decides whether a call is a reduction, nested calls are compiled once
+    REQUIRE(ctx.evalExpression("max(min(a), x) + min(min(a), x)").getResult() == Approx(10 - 5));
+    REQUIRE(ctx.evalExpression("sum(a * max(w))").getResult() == Approx(ctx.evalExpression("2 * sum(a)").getResult()));
+    REQUIRE(ctx.evalExpression("sum(a * 0 + sum(w))").getResult() == Approx(11 * 22));
+    std::string nested;
+    for (int i = 0; i < 300; i++) {
+        nested += "max(";
+    }
+    nested += "min(a)";
+    for (int i = 0; i < 300; i++) {
+        nested += ", x)";
+    }
+    REQUIRE(ctx.evalExpression(nested.c_str()).getResult() == Approx(10));
+    REQUIRE(ctx.compileExpression(nested.c_str()).eval().getResult() == Approx(10));
+
+    // Direct evaluation charges the elements of reductions before running them
+    b = {big.data(), big.size()};
+    Budget budget;
+    budget.maxOperations = 1000;
+    auto rejected        = ctx.evalExpression("sum(b * 2)", budget);
+    REQUIRE(rejected.isBudgetExceeded());
+    REQUIRE(std::string(rejected.getError()) == "In character 9: Operation budget exceeded");
+    budget.maxOperations = 100000;
+    REQUIRE(ctx.evalExpression("sum(b * 2)", budget).getResult() == Approx(990000));
+
+    // The deadline is checked between blocks
+    static size_t stalls = 0;
+    ctx.addFunction("stall", [](number_t v) -> number_t {
+        if (stalls++ == 0) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(5));
+        }
+        return v;
+    });
+    Budget deadline;
+    deadline.deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(1);
+    REQUIRE(ctx.evalExpression("sum(stall(b))", deadline).isBudgetExceeded());
+    REQUIRE(stalls == PM_BATCH_SIZE);
+
+    // Batches can't vary the variables read by reductions
+    std::vector<number_t> xs{1, 2};
+    std::vector<number_t> out(xs.size());
+    auto                  batch = ctx.compileExpression("x * 2 + min(a)");
+    REQUIRE(batch.evalBatch(xs.size(), {{&x, xs.data()}}, out.data()).isOk());
+    REQUIRE(out[1] == Approx(4 - 5));
+    REQUIRE(ctx.compileExpression("sum(a * x)").evalBatch(xs.size(), {{&x, xs.data()}}, out.data()).isError());
+}
+
+TEST_CASE("Long tokens") {
+    PicoMath    ctx;
+    std::string name(100, 'v');
+    name += "_Long";
+    ctx.addVariable(name) = 3;
+    ctx.addUnit("px")     = 2;
+
+    // Runs of every length, starting at every alignment
+    for (size_t offset = 0; offset < 40; offset++) {
+        for (size_t length = 0; length < 70; length += 3) {
+            std::string space = std::string(length, ' ') + "\t\r\n";
+            std::string expression = std::string(offset, ' ') + name + space + "*" + space + "1" +
+                                     std::string(length, '0') + ".5" + space + "+" + space + "2" + space + "px" + space;
+            number_t literal = std::stod("1" + std::string(length, '0') + ".5");
+            REQUIRE(ctx.evalExpression(expression.c_str()).getResult() == Approx(3 * literal + 4));
+            REQUIRE(ctx.compileExpression(expression.c_str()).eval().getResult() == Approx(3 * literal + 4));
+        }
+    }
+    REQUIRE(ctx.evalExpression((name + "x").c_str()).isError());
+    REQUIRE(ctx.evalExpression((name.substr(1) + " + 1").c_str()).isError());
+}
+
+TEST_CASE("Interval analysis") {
+    PicoMath ctx;
+    auto &   x = ctx.addVariable("x");
+    auto &   y = ctx.addVariable("y");
+
+    Interval linear = ctx.compileExpression("x * 2 + 1").bound({{&x, {0, 1}}});
+    REQUIRE(linear.low == Approx(1));
+    REQUIRE(linear.high == Approx(3));
+    REQUIRE(!linear.maybeNaN);
+
+    // Bounds contain every result, and NaN only appears when flagged
+    const std::vector<const char *> sources{
+        "sin(x)",       "cos(x)",       "tan(x)",      "sqrt(x)",           "ln(x)",         "log(x)",
+        "asin(x)",      "acos(x)",      "cosh(x)",     "sinh(x)",           "tanh(x)",       "abs(x)",
+        "ceil(x)",      "floor(x)",     "round(x)",    "atan2(x, y)",       "pow(x, y)",     "pow(x, 3)",
+        "pow(x, 2)",    "pow(x, -1)",   "pow(x, -2)",  "min(x, y, 2)",      "max(x, y)",     "x / y",
+        "x * y - x",    "-x * x + y",   "pow(2, x)",   "sin(x) * cos(y) + pi"};
+    const std::vector<Interval> ranges{{-3, -1}, {-0.5, 0.5}, {0.5, 2}, {1, 7}, {-20, 20}};
+    for (const char *source : sources) {
+        auto compiled = ctx.compileExpression(source);
+        for (const Interval &rx : ranges) {
+            for (const Interval &ry : ranges) {
+                Interval bound = compiled.bound({{&x, rx}, {&y, ry}});
+                for (int i = 0; i <= 16; i++) {
+                    for (int j = 0; j <= 4; j++) {
+                        x               = rx.low + (rx.high - rx.low) * i / 16;
+                        y               = ry.low + (ry.high - ry.low) * j / 4;
+                        number_t result = compiled.eval().getResult();
+                        INFO(source << " x=" << x << " y=" << y << " [" << bound.low << ", " << bound.high << "]");
+                        REQUIRE((std::isnan(result) ? bound.maybeNaN : bound.contains(result)));
+                    }
+                }
+            }
+        }
+    }
+
+    // Rules are reasonably tight
+    auto sine = ctx.compileExpression("sin(x)");
+    REQUIRE(sine.bound({{&x, {0, 1}}}).high == Approx(std::sin(1.0)));
+    REQUIRE(sine.bound({{&x, {0, 2}}}).high == Approx(1));
+    REQUIRE(sine.bound({{&x, {4, 5}}}).low == Approx(-1));
+    REQUIRE(ctx.compileExpression("sqrt(x)").bound({{&x, {-1, 4}}}).maybeNaN);
+    REQUIRE(!ctx.compileExpression("sqrt(x)").bound({{&x, {0, 4}}}).maybeNaN);
+    REQUIRE(ctx.compileExpression("pow(x, 2)").bound({{&x, {-2, 1}}}).low == Approx(0));
+    REQUIRE(std::isinf(ctx.compileExpression("1 / x").bound({{&x, {-1, 1}}}).high));
+    // Both zeros are considered for negative exponents
+    auto power = ctx.compileExpression("pow(x, y)");
+    for (number_t zero : {0.0, -0.0}) {
+        Interval bound = power.bound({{&x, {zero, 1}}, {&y, {-3, -1}}});
+        REQUIRE((std::isinf(bound.low) && bound.low < 0));
+        REQUIRE((std::isinf(bound.high) && bound.high > 0));
+    }
+
+    // A threshold that can't be crossed needs no evaluation
+    auto score = ctx.compileExpression("x * x + y");
+    REQUIRE(score.bound({{&x, {0, 1}}, {&y, {0, 1}}}).high <= 2);
+    // Variables without a range keep their value
+    y = 5;
+    REQUIRE(score.bound({{&x, {0, 1}}}).low == Approx(5));
+    // Functions without a rule can return anything
+    ctx.addFunction("twice", [](number_t v) -> number_t { return 2 * v; }, Purity::Pure);
+    auto twice = ctx.compileExpression("twice(x)");
+    REQUIRE(std::isinf(twice.bound({{&x, {0, 1}}}).high));
+    REQUIRE(ctx.setIntervalRule("twice", [](size_t /*argc*/, const Interval *args) -> Interval {
+        return {2 * args[0].low, 2 * args[0].high, args[0].maybeNaN};
+    }));
+    REQUIRE(!ctx.setIntervalRule("missing", nullptr));
+    REQUIRE(twice.bound({{&x, {0, 1}}}).high == Approx(2));
+
+    // Simplifying under ranges keeps the results inside them
+    const char *source   = "abs(x) + min(x, y + 10) + max(y, 0.5) * pi + abs(-y) + floor(x / 10 + 3)";
+    auto        assumed  = ctx.compileExpression(source);
+    auto        original = ctx.compileExpression(source);
+    assumed.assume({{&x, {1, 2}}, {&y, {2, 3}}});
+    REQUIRE(assumed.size() < original.size());
+    for (int i = 0; i <= 8; i++) {
+        x = 1 + static_cast<number_t>(i) / 8;
+        y = 3 - static_cast<number_t>(i) / 8;
+        REQUIRE(assumed.eval().getResult() == Approx(original.eval().getResult()));
+    }
+    // Variables with a single value become constants
+    auto folded = ctx.compileExpression("x * y + floor(y)");
+    folded.assume({{&x, {2, 2}}, {&y, {4.25, 4.5}}});
+    REQUIRE(folded.size() == 5); // y, 2, 2 * y, 4 and the addition
+    y = 4.5;
+    REQUIRE(folded.eval().getResult() == Approx(13));
+    // Specialized programs stay specialized
+    auto specialized = ctx.compileExpression("x * y + abs(x) + sqrt(y)");
+    specialized.specialize();
+    size_t before = specialized.size();
+    specialized.assume({{&x, {-2, -1}}});
+    REQUIRE(specialized.size() <= before);
+    x = -1.5;
+    REQUIRE(specialized.eval().getResult() == Approx(ctx.evalExpression("x * y + abs(x) + sqrt(y)").getResult()));
+}
+
+namespace {
+
+auto registerFormula(protocol::Service &service, std::initializer_list<std::string_view> names,
+                     std::string_view formula) -> std::vector<char> {
+    std::vector<char> input;
+    std::vector<char> output;
+    protocol::Writer  writer(input, protocol::Type::Register, 7);
+    writer.put(static_cast<uint16_t>(names.size()));
+    for (auto name : names) {
+        writer.put(static_cast<uint16_t>(name.size()));
+        writer.putBytes(name.data(), name.size());
+    }
+    writer.putBytes(formula.data(), formula.size());
+    writer.finish();
+    REQUIRE(service.processInput(input, output));
+    return output;
+}
+
+auto evalFormula(protocol::Service &service, uint32_t id, std::initializer_list<number_t> values) -> std::vector<char> {
+    std::vector<char> input;
+    std::vector<char> output;
+    protocol::Writer  writer(input, protocol::Type::Eval, 8);
+    writer.put(id);
+    writer.put(static_cast<uint16_t>(values.size()));
+    for (number_t value : values) {
+        writer.put(value);
+    }
+    writer.finish();
+    REQUIRE(service.processInput(input, output));
+    return output;
+}
+
+/**
+ * @brief Reads the status of a single response, and its value when it succeeded
+ */
+template <typename T>
+auto readResponse(const std::vector<char> &output, T *outValue) -> protocol::Status {
+    uint32_t length = 0;
+    REQUIRE(output.size() >= protocol::headerSize);
+    std::memcpy(&length, output.data(), sizeof(length));
+    REQUIRE(output.size() == sizeof(uint32_t) + length);
+    protocol::Reader reader(output.data() + protocol::headerSize, output.size() - protocol::headerSize);
+    protocol::Status status{};
+    REQUIRE(reader.get(status));
+    if (status == protocol::Status::Ok) {
+        REQUIRE(reader.get(*outValue));
+    }
+    return status;
+}
+
+} // namespace
+
+TEST_CASE("Formula service") {
+    protocol::Service service;
+    service.addConstant("g", 9.81);
+    service.addUnit("km", 1000);
+
+    uint32_t first = 0;
+    REQUIRE(readResponse(registerFormula(service, {"x"}, "g * 2 + x"), &first) == protocol::Status::Ok);
+    uint32_t again = 1;
+    REQUIRE(readResponse(registerFormula(service, {"x"}, "g * 2 + x"), &again) == protocol::Status::Ok);
+    REQUIRE(again == first);
+    number_t value = 0;
+    REQUIRE(readResponse(evalFormula(service, first, {1}), &value) == protocol::Status::Ok);
+    REQUIRE(AreSame(value, 20.62));
+
+    // Shared constants and units can't be declared, undeclared variables are unknown
+    uint32_t id = 0;
+    REQUIRE(readResponse(registerFormula(service, {"g"}, "g * 0"), &id) == protocol::Status::Error);
+    REQUIRE(readResponse(registerFormula(service, {"pi"}, "pi"), &id) == protocol::Status::Error);
+    REQUIRE(readResponse(registerFormula(service, {"km"}, "km"), &id) == protocol::Status::Error);
+    REQUIRE(readResponse(registerFormula(service, {"y", "y"}, "y"), &id) == protocol::Status::Error);
+    REQUIRE(readResponse(registerFormula(service, {"y"}, "y + x"), &id) == protocol::Status::Error);
+
+    // Formulas declaring the same name have their own variables
+    uint32_t second = 0;
+    REQUIRE(readResponse(registerFormula(service, {"x", "y"}, "x * y + 1km"), &second) == protocol::Status::Ok);
+    REQUIRE(readResponse(evalFormula(service, second, {3, 5}), &value) == protocol::Status::Ok);
+    REQUIRE(AreSame(value, 1015));
+    REQUIRE(readResponse(evalFormula(service, first, {0}), &value) == protocol::Status::Ok);
+    REQUIRE(AreSame(value, 19.62));
+    REQUIRE(readResponse(evalFormula(service, first, {1, 2}), &value) == protocol::Status::Error);
+    REQUIRE(readResponse(evalFormula(service, 99, {}), &value) == protocol::Status::Error);
+
+    // A malformed frame only leaves the finished responses of the previous ones
+    std::vector<char> input;
+    std::vector<char> output;
+    {
+        protocol::Writer eval(input, protocol::Type::Eval, 1);
+        eval.put(first);
+        eval.put(uint16_t{1});
+        eval.put(number_t{1});
+        eval.finish();
+        protocol::Writer truncated(input, protocol::Type::Batch, 2);
+        truncated.put(uint32_t{2});
+        truncated.put(first);
+        truncated.finish();
+    }
+    REQUIRE_FALSE(service.processInput(input, output));
+    REQUIRE(readResponse(output, &value) == protocol::Status::Ok);
+    REQUIRE(AreSame(value, 20.62));
+
+    // Partial frames wait for the rest
+    input.assign(protocol::headerSize - 1, 0);
+    output.clear();
+    REQUIRE(service.processInput(input, output));
+    REQUIRE(output.empty());
+    REQUIRE(input.size() == protocol::headerSize - 1);
+
+    // The number of registered formulas is bounded, registered ones are still found
+    protocol::Service small(2);
+    REQUIRE(readResponse(registerFormula(small, {"x"}, "x"), &id) == protocol::Status::Ok);
+    REQUIRE(readResponse(registerFormula(small, {"x"}, "x + 1"), &id) == protocol::Status::Ok);
+    REQUIRE(readResponse(registerFormula(small, {"x"}, "x + 2"), &id) == protocol::Status::Error);
+    REQUIRE(readResponse(registerFormula(small, {"x"}, "x + 1"), &again) == protocol::Status::Ok);
+    REQUIRE(again == id);
+}
@@ -0,0 +1,190 @@
+/**
+ * @brief Load generator for picomath-server.
+ * Registers a formula and sends pipelined Eval or Batch requests, keeping a fixed number of
+ * requests in flight, then reports latency percentiles and throughput.
+ *
+ * Usage: picomath-loadgen <socket path> [requests] [pipeline depth] [batch size]
+ */
+#include "protocol.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <vector>
+
+using namespace picomath;           // NOLINT
+using namespace picomath::protocol; // NOLINT
+using Clock = std::chrono::steady_clock;
+
+namespace {
+
+auto writeAll(int fd, const std::vector<char> &buffer) -> bool {
+    size_t written = 0;
+    while (written < buffer.size()) {
+        ssize_t count = ::write(fd, buffer.data() + written, buffer.size() - written);
+        if (count <= 0) {
+            return false;
+        }
+        written += static_cast<size_t>(count);
+    }
+    return true;
+}
+
+/**
+ * @brief Reads until the buffer holds at least one complete frame. Returns false if the server closed
+ */
+auto readFrame(int fd, std::vector<char> &buffer, size_t &consumed) -> bool {
+    while (true) {
+        if (buffer.size() - consumed >= sizeof(uint32_t)) {
+            uint32_t length = 0;
+            std::memcpy(&length, &buffer[consumed], sizeof(length));
+            if (buffer.size() - consumed >= sizeof(uint32_t) + length) {
+                return true;
+            }
+        }
+        if (consumed > 0) {
+            buffer.erase(buffer.begin(), buffer.begin() + static_cast<std::ptrdiff_t>(consumed));
+            consumed = 0;
+        }
+        size_t size = buffer.size();
+        buffer.resize(size + 64 * 1024);
+        ssize_t count = ::read(fd, buffer.data() + size, 64 * 1024);
+        buffer.resize(size + static_cast<size_t>(std::max<ssize_t>(count, 0)));
+        if (count <= 0) {
+            return false;
+        }
+    }
+}
+
+auto percentile(const std::vector<double> &sorted, double fraction) -> double {
+    if (sorted.empty()) {
+        return 0;
+    }
+    auto index = static_cast<size_t>(fraction * static_cast<double>(sorted.size() - 1));
+    return sorted[index];
+}
+
+} // namespace
+
+auto main(int argc, char *argv[]) -> int {
+    if (argc < 2) {
+        std::cerr << "Usage: " << argv[0] << " <socket path> [requests] [pipeline depth] [batch size]" << std::endl;
+        return 1;
+    }
+    size_t requests = argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 100000;
+    size_t depth    = argc > 3 ? std::max<size_t>(std::strtoul(argv[3], nullptr, 10), 1) : 16;
+    size_t batch    = argc > 4 ? std::strtoul(argv[4], nullptr, 10) : 0;
+
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    std::strncpy(address.sun_path, argv[1], sizeof(address.sun_path) - 1);
+    int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || ::connect(fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0) { // NOLINT
+        std::perror("Can't connect");
+        return 1;
+    }
+
+    std::vector<char> output;
+    std::vector<char> input;
+    size_t            consumed = 0;
+
+    // Register the formula
+    {
+        Writer      writer(output, Type::Register, 0);
+        const char *formula = "sqrt(x*x + y*y) * 2 + sin(x) * y";
+        writer.put(uint16_t{2});
+        for (const char *name : {"x", "y"}) {
+            writer.put(uint16_t{1});
+            writer.putBytes(name, 1);
+        }
+        writer.putBytes(formula, std::strlen(formula));
+        writer.finish();
+    }
+    if (!writeAll(fd, output) || !readFrame(fd, input, consumed)) {
+        std::cerr << "Server closed the connection" << std::endl;
+        return 1;
+    }
+    uint32_t formulaId = 0;
+    {
+        Reader   reader(&input[consumed + headerSize], input.size() - consumed - headerSize);
+        Status   status{};
+        uint32_t length = 0;
+        std::memcpy(&length, &input[consumed], sizeof(length));
+        if (!reader.get(status) || status != Status::Ok || !reader.get(formulaId)) {
+            std::cerr << "Can't register the formula" << std::endl;
+            return 1;
+        }
+        consumed += sizeof(uint32_t) + length;
+    }
+
+    // Send time of the requests in flight, indexed by tag
+    std::vector<Clock::time_point> sent(requests);
+    std::vector<double>            latencies;
+    latencies.reserve(requests);
+    size_t sentCount = 0;
+    size_t errors    = 0;
+    auto   start     = Clock::now();
+
+    while (latencies.size() < requests) {
+        output.clear();
+        while (sentCount < requests && sentCount - latencies.size() < depth) {
+            auto   tag = static_cast<uint32_t>(sentCount);
+            auto   x   = static_cast<number_t>(sentCount % 1000);
+            Writer writer(output, batch == 0 ? Type::Eval : Type::Batch, tag);
+            if (batch != 0) {
+                writer.put(static_cast<uint32_t>(batch));
+            }
+            for (size_t entry = 0; entry < std::max<size_t>(batch, 1); entry++) {
+                writer.put(formulaId);
+                writer.put(uint16_t{2});
+                writer.put(x);
+                writer.put(static_cast<number_t>(entry));
+            }
+            writer.finish();
+            sent[sentCount++] = Clock::now();
+        }
+        if (!output.empty() && !writeAll(fd, output)) {
+            std::cerr << "Server closed the connection" << std::endl;
+            return 1;
+        }
+        if (!readFrame(fd, input, consumed)) {
+            std::cerr << "Server closed the connection" << std::endl;
+            return 1;
+        }
+        // Handle every complete response
+        while (input.size() - consumed >= headerSize) {
+            uint32_t length = 0;
+            std::memcpy(&length, &input[consumed], sizeof(length));
+            if (input.size() - consumed < sizeof(uint32_t) + length) {
+                break;
+            }
+            uint32_t tag = 0;
+            std::memcpy(&tag, &input[consumed + sizeof(uint32_t) + 1], sizeof(tag));
+            Status status{};
+            std::memcpy(&status, &input[consumed + headerSize + (batch == 0 ? 0 : sizeof(uint32_t))], 1);
+            errors += status == Status::Ok ? 0 : 1;
+            std::chrono::duration<double, std::micro> latency = Clock::now() - sent[tag];
+            latencies.push_back(latency.count());
+            consumed += sizeof(uint32_t) + length;
+        }
+    }
+    std::chrono::duration<double> elapsed = Clock::now() - start;
+    ::close(fd);
+
+    std::sort(latencies.begin(), latencies.end());
+    double evaluations = static_cast<double>(requests * std::max<size_t>(batch, 1));
+    std::cout << "Requests:    " << requests << " (pipeline " << depth << ", batch " << batch << ")" << std::endl;
+    std::cout << "Errors:      " << errors << std::endl;
+    std::cout << "Throughput:  " << static_cast<double>(requests) / elapsed.count() << " requests/s, "
+              << evaluations / elapsed.count() << " evaluations/s" << std::endl;
+    std::cout << "Latency p50: " << percentile(latencies, 0.50) << " us" << std::endl;
+    std::cout << "Latency p99: " << percentile(latencies, 0.99) << " us" << std::endl;
+    std::cout << "Latency max: " << percentile(latencies, 1.0) << " us" << std::endl;
+    return 0;
+}
@@ -0,0 +1,115 @@
+/**
+ * @file protocol.hpp
+ * @brief Binary protocol of the PicoMath formula server. BSD 3-Clause License
+ *
+ * Every message is a frame: a uint32 length of the rest of the frame, a uint8 message type and a
+ * uint32 tag that the server copies to the response. Requests are pipelined: a client can send
+ * many frames without waiting, and responses arrive in the same order. Numbers use the host byte
+ * order, as the server only listens on a Unix domain socket.
+ *
+ * Requests:
+ *   Register: uint16 variable count, (uint16 length, name) per variable, formula text until the end
+ *   Eval:     uint32 formula id, uint16 value count, number_t values in the registered order
+ *   Batch:    uint32 entry count, then an Eval body per entry
+ *
+ * Responses have the same type and tag as their request:
+ *   Register: uint8 status, then the uint32 formula id or the error text
+ *   Eval:     uint8 status, then the number_t result or the error text
+ *   Batch:    uint32 entry count, then uint8 status and number_t result per entry
+ */
+#ifndef PICOMATH_PROTOCOL_HPP
+#define PICOMATH_PROTOCOL_HPP
+
+#include <cstdint>
+#include <cstring>
+#include <picomath.hpp>
+#include <vector>
+
+namespace picomath::protocol {
+
+enum class Type : uint8_t
+{
+    Register = 1,
+    Eval     = 2,
+    Batch    = 3
+};
+
+enum class Status : uint8_t
+{
+    Ok    = 0,
+    Error = 1
+};
+
+// Length, type and tag
+constexpr size_t headerSize = sizeof(uint32_t) + sizeof(uint8_t) + sizeof(uint32_t);
+
+// Frames longer than this close the connection
+constexpr uint32_t maxFrameSize = 64U * 1024U * 1024U;
+
+/**
+ * @brief Appends values to a frame, patching its length when finished
+ */
+class Writer {
+    std::vector<char> &buffer;
+    size_t             start;
+
+  public:
+    Writer(std::vector<char> &output, Type type, uint32_t tag) : buffer(output), start(output.size()) {
+        put(uint32_t{0});
+        put(type);
+        put(tag);
+    }
+
+    template <typename T>
+    auto put(T value) -> void {
+        const char *bytes = reinterpret_cast<const char *>(&value); // NOLINT
+        buffer.insert(buffer.end(), bytes, bytes + sizeof(T));
+    }
+
+    auto putBytes(const char *data, size_t size) -> void {
+        buffer.insert(buffer.end(), data, data + size);
+    }
+
+    auto finish() -> void {
+        auto length = static_cast<uint32_t>(buffer.size() - start - sizeof(uint32_t));
+        std::memcpy(&buffer[start], &length, sizeof(length));
+    }
+};
+
+/**
+ * @brief Reads values from the body of a frame, failing instead of reading past its end
+ */
+class Reader {
+    const char *data;
+    const char *end;
+
+  public:
+    Reader(const char *body, size_t size) : data(body), end(body + size) {
+    }
+
+    template <typename T>
+    auto get(T &value) -> bool {
+        if (static_cast<size_t>(end - data) < sizeof(T)) {
+            return false;
+        }
+        std::memcpy(&value, data, sizeof(T));
+        data += sizeof(T);
+        return true;
+    }
+
+    auto getBytes(const char *&bytes, size_t size) -> bool {
+        if (static_cast<size_t>(end - data) < size) {
+            return false;
+        }
+        bytes = data;
+        data += size;
+        return true;
+    }
+
+    [[nodiscard]] auto remaining() const -> size_t {
+        return static_cast<size_t>(end - data);
+    }
+};
+
+} // namespace picomath::protocol
+#endif
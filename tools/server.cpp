@@ -0,0 +1,248 @@
+/**
+ * @brief Local formula evaluation server.
+ * Serves pipelined requests of every client over a Unix domain socket from a cache of compiled
+ * formulas. Constants and units are shared, the variables of each formula are private. See
+ * protocol.hpp for the wire format and service.hpp for the handling of requests.
+ *
+ * Usage: picomath-server <socket path> [table file]
+ * The table file configures the shared context, one entry per line: `unit <name> <scale>` or
+ * `constant <name> <value>`.
+ */
+#include "protocol.hpp"
+#include "service.hpp"
+
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <picomath.hpp>
+#include <sstream>
+#include <string>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+
+using namespace picomath;           // NOLINT
+using namespace picomath::protocol; // NOLINT
+
+namespace {
+
+volatile std::sig_atomic_t running = 1; // NOLINT
+
+// Unsent output above which a connection stops being read, until the client reads its replies
+constexpr size_t maxPendingOutput = 4U * 1024U * 1024U;
+
+struct Connection {
+    std::vector<char> input{};
+    std::vector<char> output{};
+    size_t            written{0};
+    uint32_t          events{EPOLLIN};
+};
+
+class Server {
+    Service                             service{};
+    std::unordered_map<int, Connection> connections{};
+    int                                 epollFd{-1};
+    int                                 listenFd{-1};
+
+    auto watch(int fd, uint32_t events, int operation) const -> void {
+        epoll_event event{};
+        event.events  = events;
+        event.data.fd = fd;
+        epoll_ctl(epollFd, operation, fd, &event);
+    }
+
+    auto close(int fd) -> void {
+        epoll_ctl(epollFd, EPOLL_CTL_DEL, fd, nullptr);
+        ::close(fd);
+        connections.erase(fd);
+    }
+
+    auto flush(int fd, Connection &connection) -> bool {
+        std::vector<char> &output = connection.output;
+        while (connection.written < output.size()) {
+            ssize_t count = ::write(fd, output.data() + connection.written, output.size() - connection.written);
+            if (count < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    break;
+                }
+                if (errno == EINTR) {
+                    continue;
+                }
+                return false;
+            }
+            connection.written += static_cast<size_t>(count);
+        }
+        size_t pending = output.size() - connection.written;
+        if (pending == 0) {
+            output.clear();
+            connection.written = 0;
+        }
+        // A client that doesn't read its replies is not read either, so they can't pile up
+        uint32_t events = (pending > 0 ? EPOLLOUT : 0U) | (pending <= maxPendingOutput ? EPOLLIN : 0U);
+        if (events != connection.events) {
+            connection.events = events;
+            watch(fd, events, EPOLL_CTL_MOD);
+        }
+        return true;
+    }
+
+    /**
+     * @brief Reads what is available, up to one maximum frame. The rest stays in the socket
+     * and wakes epoll again once the frames read are handled
+     */
+    auto receive(int fd, Connection &connection) -> bool {
+        std::vector<char> &input = connection.input;
+        while (input.size() < sizeof(uint32_t) + maxFrameSize) {
+            size_t size = input.size();
+            input.resize(size + 64 * 1024);
+            ssize_t count = ::read(fd, input.data() + size, 64 * 1024);
+            input.resize(size + static_cast<size_t>(std::max<ssize_t>(count, 0)));
+            if (count == 0) {
+                return false;
+            }
+            if (count < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    return true;
+                }
+                if (errno != EINTR) {
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+
+    auto accept() -> void {
+        while (true) {
+            int fd = ::accept4(listenFd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (fd < 0) {
+                return;
+            }
+            connections[fd];
+            watch(fd, EPOLLIN, EPOLL_CTL_ADD);
+        }
+    }
+
+  public:
+    Server() = default;
+
+    Server(const Server &) = delete;
+    auto operator=(const Server &) -> Server & = delete;
+
+    ~Server() {
+        for (auto &connection : connections) {
+            ::close(connection.first);
+        }
+        if (listenFd >= 0) {
+            ::close(listenFd);
+        }
+        if (epollFd >= 0) {
+            ::close(epollFd);
+        }
+    }
+
+    auto loadTable(const char *path) -> bool {
+        std::ifstream file(path);
+        if (!file) {
+            return false;
+        }
+        std::string line;
+        while (std::getline(file, line)) {
+            std::istringstream fields(line);
+            std::string        kind;
+            std::string        name;
+            number_t           value = 0;
+            if (!(fields >> kind) || kind[0] == '#') {
+                continue;
+            }
+            if (!(fields >> name >> value) || (kind != "unit" && kind != "constant")) {
+                std::cerr << "Invalid table entry: " << line << std::endl;
+                return false;
+            }
+            if (kind == "unit") {
+                service.addUnit(name, value);
+            } else {
+                service.addConstant(name, value);
+            }
+        }
+        return true;
+    }
+
+    auto listen(const char *path) -> bool {
+        sockaddr_un address{};
+        if (std::strlen(path) >= sizeof(address.sun_path)) {
+            return false;
+        }
+        address.sun_family = AF_UNIX;
+        std::strncpy(address.sun_path, path, sizeof(address.sun_path) - 1);
+        ::unlink(path);
+        listenFd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        epollFd  = ::epoll_create1(EPOLL_CLOEXEC);
+        if (listenFd < 0 || epollFd < 0 ||
+            ::bind(listenFd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0 || // NOLINT
+            ::listen(listenFd, SOMAXCONN) != 0) {
+            return false;
+        }
+        watch(listenFd, EPOLLIN, EPOLL_CTL_ADD);
+        return true;
+    }
+
+    auto run() -> void {
+        std::array<epoll_event, 64> events{};
+        while (running != 0) {
+            int count = ::epoll_wait(epollFd, events.data(), static_cast<int>(events.size()), -1);
+            for (int i = 0; i < count; i++) {
+                int fd = events[static_cast<size_t>(i)].data.fd;
+                if (fd == listenFd) {
+                    accept();
+                    continue;
+                }
+                auto found = connections.find(fd);
+                if (found == connections.end()) {
+                    continue;
+                }
+                Connection &connection = found->second;
+                uint32_t    ready      = events[static_cast<size_t>(i)].events;
+                bool        open       = (ready & (EPOLLERR | EPOLLHUP)) == 0 || (ready & EPOLLIN) != 0;
+                if (open && (ready & EPOLLIN) != 0) {
+                    // A closed peer can still have complete frames in the buffer
+                    bool readable = receive(fd, connection);
+                    open          = service.processInput(connection.input, connection.output) && readable;
+                }
+                if (!flush(fd, connection) || !open) {
+                    close(fd);
+                }
+            }
+        }
+    }
+};
+
+} // namespace
+
+auto main(int argc, char *argv[]) -> int {
+    if (argc < 2) {
+        std::cerr << "Usage: " << argv[0] << " <socket path> [table file]" << std::endl;
+        return 1;
+    }
+    std::signal(SIGPIPE, SIG_IGN);
+    std::signal(SIGINT, [](int /*signal*/) { running = 0; });
+    std::signal(SIGTERM, [](int /*signal*/) { running = 0; });
+
+    Server server;
+    if (argc > 2 && !server.loadTable(argv[2])) {
+        std::cerr << "Can't load table " << argv[2] << std::endl;
+        return 1;
+    }
+    if (!server.listen(argv[1])) {
+        std::perror("Can't listen");
+        return 1;
+    }
+    server.run();
+    ::unlink(argv[1]);
+    return 0;
+}
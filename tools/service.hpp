@@ -0,0 +1,239 @@
+/**
+ * @file service.hpp
+ * @brief Request handling of the PicoMath formula server, independent of sockets. BSD 3-Clause License
+ *
+ * The shared context only holds the constants and units of the table. Every registered formula
+ * gets a context forked from it, with private storage for its declared variables, so clients
+ * can't change each other's constants or read each other's variables.
+ */
+#ifndef PICOMATH_SERVICE_HPP
+#define PICOMATH_SERVICE_HPP
+
+#include "protocol.hpp"
+
+#include <cstdint>
+#include <cstring>
+#include <map>
+#include <picomath.hpp>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace picomath::protocol {
+
+class Service {
+    struct Formula {
+        PicoMath                context;
+        CompiledExpression      program{};
+        std::vector<number_t *> variables{};
+    };
+
+    PicoMath                                     shared{};
+    size_t                                       maxFormulas;
+    std::vector<Formula>                         formulas{};
+    std::map<std::string, uint32_t, std::less<>> cache{};
+    std::string                                  key{};
+
+    static auto putError(Writer &writer, const char *error) -> void {
+        writer.put(Status::Error);
+        writer.putBytes(error, std::strlen(error));
+    }
+
+    auto registerFormula(Reader &reader, Writer &writer) -> bool {
+        uint16_t count = 0;
+        if (!reader.get(count)) {
+            return false;
+        }
+        // The cache key is the variable names followed by the formula, reusing the same buffer
+        key.clear();
+        std::vector<std::string_view> names;
+        for (uint16_t i = 0; i < count; i++) {
+            uint16_t    length = 0;
+            const char *name   = nullptr;
+            if (!reader.get(length) || !reader.getBytes(name, length)) {
+                return false;
+            }
+            names.emplace_back(name, length);
+            key.append(name, length);
+            key += '\n';
+        }
+        const char *text   = nullptr;
+        size_t      length = reader.remaining();
+        reader.getBytes(text, length);
+        key += '\n';
+        key.append(text, length);
+
+        auto cached = cache.find(key);
+        if (cached != cache.end()) {
+            writer.put(Status::Ok);
+            writer.put(cached->second);
+            return true;
+        }
+
+        // Registered formulas are never dropped, so clients can't grow them without limit
+        if (formulas.size() >= maxFormulas) {
+            putError(writer, "Too many formulas");
+            return true;
+        }
+        Formula formula{shared.fork()};
+        for (auto name : names) {
+            // Shared constants and units can't be redeclared, and each name is declared once
+            if (formula.context.hasVariable(name) || formula.context.hasUnit(name)) {
+                std::string error = "Variable already defined `" + std::string(name) + '`';
+                putError(writer, error.c_str());
+                return true;
+            }
+            formula.variables.push_back(&formula.context.addVariable(std::string(name)));
+        }
+        // Identifiers that were not declared are unknown in the private context
+        std::string source(text, length);
+        formula.program = formula.context.compileExpression(source.c_str());
+        if (formula.program.isError()) {
+            putError(writer, formula.program.getError());
+            return true;
+        }
+        auto id = static_cast<uint32_t>(formulas.size());
+        formulas.push_back(std::move(formula));
+        cache.emplace(key, id);
+        writer.put(Status::Ok);
+        writer.put(id);
+        return true;
+    }
+
+    /**
+     * @brief Evaluates one formula. Returns false if the request is malformed
+     */
+    auto evaluate(Reader &reader, Result *outResult) -> bool {
+        uint32_t id    = 0;
+        uint16_t count = 0;
+        if (!reader.get(id) || !reader.get(count)) {
+            return false;
+        }
+        Formula *formula = id < formulas.size() ? &formulas[id] : nullptr;
+        bool     valid   = formula != nullptr && formula->variables.size() == count;
+        for (uint16_t i = 0; i < count; i++) {
+            number_t value = 0;
+            if (!reader.get(value)) {
+                return false;
+            }
+            if (valid) {
+                *formula->variables[i] = value;
+            }
+        }
+        if (!valid) {
+            *outResult = formula == nullptr ? Result("Unknown formula") : Result("Invalid number of variables");
+            return true;
+        }
+        *outResult = formula->program.eval();
+        return true;
+    }
+
+    auto handleFrame(std::vector<char> &output, Type type, uint32_t tag, Reader &reader) -> bool {
+        Writer writer(output, type, tag);
+        switch (type) {
+            case Type::Register:
+                if (!registerFormula(reader, writer)) {
+                    return false;
+                }
+                break;
+            case Type::Eval: {
+                Result result;
+                if (!evaluate(reader, &result)) {
+                    return false;
+                }
+                if (result.isOk()) {
+                    writer.put(Status::Ok);
+                    writer.put(result.getResult());
+                } else {
+                    putError(writer, result.getError());
+                }
+                break;
+            }
+            case Type::Batch: {
+                uint32_t entries = 0;
+                if (!reader.get(entries)) {
+                    return false;
+                }
+                writer.put(entries);
+                for (uint32_t i = 0; i < entries; i++) {
+                    Result result;
+                    if (!evaluate(reader, &result)) {
+                        return false;
+                    }
+                    writer.put(result.isOk() ? Status::Ok : Status::Error);
+                    writer.put(result.isOk() ? result.getResult() : std::numeric_limits<number_t>::quiet_NaN());
+                }
+                break;
+            }
+            default:
+                return false;
+        }
+        writer.finish();
+        return true;
+    }
+
+  public:
+    /**
+     * @param formulaLimit Maximum number of registered formulas. Formulas that are already
+     * registered can still be registered again once it is reached
+     */
+    explicit Service(size_t formulaLimit = 1U << 16) : maxFormulas(formulaLimit) {
+    }
+
+    /**
+     * @brief Adds a constant readable by every formula. Must be called before the first registration
+     */
+    auto addConstant(const std::string &name, number_t value) -> void {
+        shared.addVariable(name) = value;
+    }
+
+    /**
+     * @brief Adds a unit usable by every formula. Must be called before the first registration
+     */
+    auto addUnit(const std::string &name, number_t value) -> void {
+        shared.addUnit(name) = value;
+    }
+
+    /**
+     * @brief Handles every complete frame of the input, appending the responses to the output.
+     * Handled frames are removed from the input, a partial frame stays at its beginning.
+     *
+     * @return false The input is malformed and the connection must be closed. The output only
+     * holds the responses of the frames before the malformed one
+     */
+    auto processInput(std::vector<char> &input, std::vector<char> &output) -> bool {
+        size_t consumed = 0;
+        bool   valid    = true;
+        while (input.size() - consumed >= headerSize) {
+            uint32_t length = 0;
+            std::memcpy(&length, &input[consumed], sizeof(length));
+            if (length > maxFrameSize || length < headerSize - sizeof(uint32_t)) {
+                valid = false;
+                break;
+            }
+            if (input.size() - consumed < sizeof(uint32_t) + length) {
+                break;
+            }
+            Reader   header(&input[consumed + sizeof(uint32_t)], length);
+            Type     type{};
+            uint32_t tag = 0;
+            header.get(type);
+            header.get(tag);
+            Reader body(&input[consumed + headerSize], length - (headerSize - sizeof(uint32_t)));
+            size_t start = output.size();
+            if (!handleFrame(output, type, tag, body)) {
+                // Drop the unfinished response, so it isn't sent before closing
+                output.resize(start);
+                valid = false;
+                break;
+            }
+            consumed += sizeof(uint32_t) + length;
+        }
+        // Keep the partial frame at the beginning, the buffer keeps its capacity
+        input.erase(input.begin(), input.begin() + static_cast<std::ptrdiff_t>(consumed));
+        return valid;
+    }
+};
+
+} // namespace picomath::protocol
+#endif